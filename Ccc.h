@@ -1,13 +1,18 @@
 #define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "libccc.h"
+
 typedef struct Type Type;
+typedef struct Node Node;
 
 //
 // tokenize.c
@@ -29,13 +34,15 @@ struct Token {
   int val;        // kindがTK_NUMの場合、その数値
   char *loc;      // トークンの位置
   int len;        // トークンの長さ
+  int line_no;    // 行番号
+  int col;        // 行の先頭からの桁 (1から)
 };
 
-void error(char *fmt, ...);
-void error_at(char *loc, char *fmt, ...);
-void error_tok(Token *tok, char *fmt, ...);
+void error(Compiler *cc, char *fmt, ...);
+void error_at(Compiler *cc, char *loc, char *fmt, ...);
+void error_tok(Compiler *cc, Token *tok, char *fmt, ...);
 bool equal(Token *tok, char *op);
-Token *tokenize(char *p);
+Token *tokenize(Compiler *cc, char *p);
 
 //
 // parse.c
@@ -50,6 +57,11 @@ struct Obj {
   Type *ty;   // 変数の型
   int len;    // 名前の長さ
   int offset; // RBPからのオフセット
+
+  // スタックスロットの割り当てに使う
+  Node *loop;     // 宣言を囲む最内のループ。なければNULL
+  int live_start; // 生存区間の開始位置。参照がなければ0
+  int live_end;   // 生存区間の終了位置
 };
 
 // 抽象構文木のノードの種類
@@ -78,7 +90,6 @@ typedef enum {
 } NodeKind;
 
 // 抽象構文木のノードの型
-typedef struct Node Node;
 struct Node {
   NodeKind kind; // ノードの型
 
@@ -100,16 +111,35 @@ struct Node {
 
   // Function call
   char *funcname;
+  Node *args; // 引数。nextでつながる
 
   Obj *var; // kindがND_LVARの場合のみ使う
   int val;   // kindがND_NUMの場合のみ使う
+
+  int prof_id; // ifとループのプロファイルのカウンタの番号 (pgo.c)
+
+  // ソース上の位置。-gのときに.locで出力する。不明なら0
+  int line_no;
+  int col;
 };
 
+// ノードの子を指すフィールドのアドレスの配列の初期化子
+#define NODE_CHILDREN(n)                                                       \
+  { &(n)->next, &(n)->lhs, &(n)->rhs, &(n)->cond, &(n)->then,                  \
+    &(n)->els,  &(n)->init, &(n)->inc, &(n)->body, &(n)->args }
+#define NCHILDREN 10
+
+// レジスタで渡せる引数の数
+#define MAX_ARGS 6
+
 // Function
 typedef struct Function Function;
 struct Function {
+  Function *next;
+  char *name;
   Node *body;
   Obj *locals;
+  Obj *params; // 引数。宣言順に並び、localsの末尾と共有する
   int stack_size;
 };
 
@@ -124,25 +154,367 @@ typedef enum {
 
 struct Type {
   TypeKind kind;
+  int size;  // sizeof()の値
+  int align; // アライメント
 
   // Pointer
   Type *base;
-
-  // Declaration 宣言
-  Token *name;
 };
 
 extern Type *ty_int;
 
 bool is_integer(Type *ty);
-Type *pointer_to(Type *base);
-void add_type(Node *node);
-
+Type *pointer_to(Compiler *cc, Type *base);
+void add_type(Compiler *cc, Node *node);
 
-Function *parse(Token *tok);
+void expect_eof(Compiler *cc);
+Node *block_item(Compiler *cc);
+Function *function(Compiler *cc, Function *prog);
+void check_calls(Compiler *cc, Function *prog);
+Function *parse(Compiler *cc, Token *tok);
 
 //
 // codegen.c
 //
 
-void codegen(Function *prog);
+void println(Compiler *cc, char *fmt, ...);
+void print_asm_string(FILE *out, char *s);
+void codegen(Compiler *cc, Function *prog);
+
+//
+// ir.c
+//
+
+void write_ir(Compiler *cc, Function *prog, FILE *out);
+Function *read_ir(Compiler *cc, const void *buf, size_t len);
+
+//
+// lto.c
+//
+
+Function *find_function(Function *prog, char *name);
+Function *optimize_program(Compiler *cc, Function *prog);
+
+//
+// main.c
+//
+
+char *format(char *fmt, ...);
+
+//
+// cache.c
+//
+
+typedef int CompileFn(Compiler *cc, const char *src, char **out, size_t *len);
+
+extern char *cache_dir;
+
+void cache_init(void);
+void cache_key(char *src, char *flags, char key[65]);
+char *cache_lookup(char *key, size_t *len);
+void cache_store(char *key, char *buf, size_t len);
+int cached_compile(Compiler *cc, char *src, char *flags, CompileFn *compile,
+                   char **out, size_t *len);
+void cache_flush_stats(void);
+int print_cache_stats(void);
+
+//
+// server.c
+//
+
+int run_server(char *path);
+int run_client(char *path, char kind, char *src, char *output);
+
+//
+// compiler.c
+//
+
+void *arena_alloc(Compiler *cc, size_t size);
+char *arena_strndup(Compiler *cc, char *p, size_t len);
+void arena_release(Compiler *cc);
+void reset(Compiler *cc);
+
+//
+// edit.c
+//
+
+void close_document(Compiler *cc);
+
+//
+// trace.c
+//
+
+void phase_begin(Compiler *cc, char *name);
+void phase_end(Compiler *cc);
+void trace_begin(Compiler *cc, char *name);
+void trace_end(Compiler *cc);
+void print_json_string(FILE *out, char *s);
+
+// パース途中の文 (parse.c)
+typedef struct {
+  Node *node;  // パース途中の文
+  Node *cur;   // ブロックの最後の文 (ND_BLOCKのみ)
+  Node *saved; // 退避したcur_loop (ループのみ)
+} StmtFrame;
+
+// 演算子の種類 (parse.c)
+typedef enum {
+  OP_PAREN, // "(" の目印
+  OP_ASSIGN,
+  OP_EQ,
+  OP_NE,
+  OP_LT,
+  OP_LE,
+  OP_GT,
+  OP_GE,
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_NEG,   // unary -
+  OP_ADDR,  // unary &
+  OP_DEREF, // unary *
+  OP_CALL,  // 引数のある関数呼び出しの "(" の目印
+  OP_COMMA, // 引数の区切りの目印
+} OpKind;
+
+// add_typeで未処理のノード。expandedなら子はすでに処理済み (type.c)
+typedef struct {
+  Node *node;
+  bool expanded;
+} TypeFrame;
+
+// 木をたどる途中の状態 (codegen.c)
+typedef struct {
+  Node *node;
+  bool addr;  // trueなら値ではなくアドレスを計算する
+  int state;  // 次に実行する段階
+  int label;  // if/ループのラベル番号
+  Node *next; // ブロックで次に処理する文
+  int layout; // ifの配置 (IfLayout)
+  int copies; // ループ本体を出力する残りの回数
+} Frame;
+
+// プロファイルに基づくifの配置 (pgo.c)
+typedef enum {
+  IF_DEFAULT,   // thenを続けて置き、elseへ分岐する
+  IF_COLD_ELSE, // elseを関数の後ろに置く
+  IF_COLD_THEN, // thenを関数の後ろに置き、thenへ分岐する
+  IF_CMOV,      // 両方の値を計算してcmovで選ぶ
+} IfLayout;
+
+typedef struct {
+  Frame *data;
+  int len;
+  int cap;
+} FrameStack;
+
+// 生存区間の解析中のループ (codegen.c)
+typedef struct {
+  Node *node;
+  int lo; // ループ先頭の位置
+  int hi; // ループ末尾の位置
+} LoopRange;
+
+// コンパイル中に確保したメモリのブロック
+typedef struct Arena Arena;
+struct Arena {
+  Arena *next;
+  size_t used;
+  size_t cap;
+  char data[];
+};
+
+// 開いているソースのトップレベルの宣言か文、または関数定義 (edit.c)
+typedef struct {
+  int start;     // ソース中の開始位置。次の要素の開始位置までが範囲
+  Node *node;
+  Obj *locals;   // この要素の直前で見えている変数
+  bool declares; // 変数を宣言しているか
+  Function *fn;  // 関数定義の並びのときは、この要素の関数
+} TopItem;
+
+// ccc_openで開き、ccc_editで少しずつ書き換えるソース (edit.c)
+typedef struct {
+  char *src;  // 現在のソース
+  int len;
+  int cap;
+  Arena *arena;     // トークン列と構文木のメモリ
+  size_t full_size; // 全体をパースした直後のarenaの大きさ
+  Function *prog;
+  Node *body;   // トップレベルの複合文。関数定義の並びならNULL
+  int body_end; // 閉じ括弧"}"の位置。関数定義の並びならソースの終わり
+  TopItem *items;
+  int items_len;
+  int items_cap;
+  bool valid; // falseならエラーがあり、次の編集で全体をパースし直す
+} Document;
+
+// 計測中の区間 (trace.c)
+typedef struct {
+  char *name;
+  bool phase;  // 段階として集計するか
+  double wall; // 開始時刻 (マイクロ秒)
+  double cpu;
+  long allocs; // 開始時点の確保の回数
+  size_t bytes;
+  // 入れ子になった段階の分
+  double child_wall;
+  double child_cpu;
+  long child_allocs;
+  size_t child_bytes;
+} Span;
+
+// 段階ごとの集計 (trace.c)
+typedef struct {
+  char *name;
+  int calls;
+  double wall; // マイクロ秒
+  double cpu;
+  long allocs;
+  size_t bytes;
+  long max_rss; // 段階の終わりでのピークのRSS (KiB)
+} PhaseStats;
+
+// トレースに書き出す区間 (trace.c)
+typedef struct {
+  char *name;
+  double ts;  // 開始時刻 (マイクロ秒)
+  double dur;
+  long allocs;
+  size_t bytes;
+  int tid;
+} TraceEvent;
+
+typedef struct {
+  int tid; // トレースでのスレッド番号
+  Span *spans;
+  int spans_len;
+  int spans_cap;
+  PhaseStats *phases;
+  int phases_len;
+  TraceEvent *events;
+  int events_len;
+  int events_cap;
+} Profile;
+
+void free_profile(Profile *prof);
+
+// 関数ごとのコード生成の統計 (stats.c)
+typedef struct {
+  char *name;
+  int insns; // 命令の数
+  int pushes;
+  int pops;
+  int loads;  // メモリからの読み込み (push/popを除く)
+  int stores; // メモリへの書き込み (push/popを除く)
+  int branches;
+  int calls;
+  int idivs;
+  int imuls;
+  int frame_size; // assign_lvar_offsetsが決めたフレームの大きさ
+  int max_depth;  // 式の評価でスタックに積んだ最大の深さ
+} FnStats;
+
+typedef struct {
+  FnStats *data;
+  int len;
+  int cap;
+} StatsTable;
+
+// プロファイルの関数ごとの回数 (pgo.c)
+typedef struct {
+  char *name;
+  unsigned long hash; // 構文木のハッシュ
+  long *counts;
+  int ncounts;
+} PgoFunc;
+
+typedef struct {
+  PgoFunc *funcs;
+  int len;
+} PgoData;
+
+void free_pgo(PgoData *data);
+void begin_pgo(Compiler *cc, Function *fn);
+void flush_cold(Compiler *cc);
+void end_pgo(Compiler *cc, Function *fn);
+void count_edge(Compiler *cc, Node *node, int edge);
+IfLayout if_layout(Compiler *cc, Node *node);
+int unroll_count(Compiler *cc, Node *node);
+bool cmov_candidate(Node *node, Node **then, Node **els);
+int count_nodes_upto(Node *node, int limit);
+
+void clear_stats(StatsTable *t);
+void free_stats(StatsTable *t);
+void begin_fn_stats(Compiler *cc, Function *fn);
+void end_fn_stats(Compiler *cc);
+void count_insn(Compiler *cc, char *line);
+
+// コンパイラの状態。1つの翻訳単位のコンパイルに必要な状態をすべて持つので、
+// スレッドごとに別のCompilerを使えば並行してコンパイルできる。
+struct Compiler {
+  FILE *out;      // アセンブリの出力先
+  jmp_buf jmpbuf; // エラー時の脱出先
+  char *errmsg;   // 最後のエラーメッセージ
+  Arena *arena;   // コンパイル中に確保したメモリ
+  char *entry;    // 生成する関数の名前。NULLならmain
+  char *debug_file; // .fileに書くソースの名前。NULLなら行番号を出力しない
+  Profile *prof;  // 計測しないならNULL
+  StatsTable *stats; // 統計を取らないならNULL
+  long alloc_count; // arenaから確保した回数
+  size_t alloc_bytes;
+
+  // tokenize.c
+  char *user_input;
+
+  // parse.c
+  Token *token;
+  Obj *locals;
+  Node *cur_loop; // パース中の最内のループ
+  StmtFrame *stmt_stack;
+  int stmt_len;
+  int stmt_cap;
+  OpKind *op_stack;
+  int op_len;
+  int op_cap;
+  Node **operand_stack;
+  int operand_len;
+  int operand_cap;
+
+  // type.c
+  TypeFrame *type_stack;
+  int type_len;
+  int type_cap;
+
+  // codegen.c
+  Function *cur_fn;
+  bool leaf; // 現在の関数はフレームを作らず、レッドゾーンを使う
+  int labelCounter;
+  int depth;
+  int max_depth;
+  FrameStack expr_frames;
+  FrameStack stmt_frames;
+  LoopRange *loops; // 出現したすべてのループ
+  int loops_len;
+  int loops_cap;
+  int *open_loops; // 解析中のループのスタック (loopsの添字)
+  int open_len;
+  int live_pos;   // 現在の位置
+  int *live_loop; // 変数ごとの、生存区間を延長すべきループ (添字+1)
+
+  // pgo.c
+  char *pgo_path;   // -fprofile-generateの出力先。NULLなら回数を数えない
+  PgoData *pgo;     // -fprofile-useで読んだプロファイル
+  long *pgo_counts; // 現在の関数の回数。なければNULL
+  unsigned long pgo_hash;
+  int nbranches;
+  FILE *hot;  // 関数の本体の出力先
+  FILE *cold; // 行外に出す腕の出力先
+  char *cold_buf;
+  size_t cold_len;
+  char *warnings;
+
+  // edit.c
+  Document doc;
+};
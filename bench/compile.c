@@ -0,0 +1,366 @@
+// コンパイル時間のベンチマーク
+//
+// 各段階に負荷をかけるソースを大きさを倍々にしながら生成し、
+// トークナイズ、パース、コード生成にかかる時間とピークのRSSを測る。
+// 大きさに対して線形より速く伸びる段階があれば知らせ、結果をJSONで書き出す。
+//
+//   bench/compile [-o FILE] [GENERATOR...]
+
+#include "../Ccc.h"
+
+#include <math.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN_SIZE 1000
+#define MAX_SIZE 256000
+#define REPEAT 3
+// 1回のコンパイルがこれを超えたら、それより大きい入力は測らない
+#define TIME_LIMIT 2.0
+// 大きさを4倍にしたときの時間の伸びがこの指数を超えることが、
+// 続く2つの大きさで起きたら線形でないとみなす
+#define SUPERLINEAR 1.3
+// これより短い時間はタイマーの分解能やキャッシュの影響で揺れるので判定しない
+#define MIN_JUDGE_TIME 0.02
+
+enum { TOKENIZE, PARSE, CODEGEN, NPHASES };
+static char *phase_names[] = {"tokenize", "parse", "codegen"};
+
+typedef struct {
+  char *name;
+  void (*gen)(FILE *out, int n);
+} Generator;
+
+// 子プロセスから受け取る測定結果
+typedef struct {
+  bool ok;
+  long max_rss; // KiB
+  long tokens;
+  long nodes;
+  double time[NPHASES]; // 各段階の最短の時間 (秒)
+} Sample;
+
+typedef struct {
+  char *gen;
+  int size;
+  long bytes;
+  Sample s;
+} Result;
+
+static void gen_tokens(FILE *out, int n) {
+  fprintf(out, "{ int x=0; ");
+  for (int i = 0; i < n / 6; i++)
+    fprintf(out, "x=x+%d; ", i);
+  fprintf(out, "return x; }");
+}
+
+// 最も古い変数を参照するので、find_lvarは毎回すべての変数をたどる
+static void gen_locals(FILE *out, int n) {
+  fprintf(out, "{ int v0=1; ");
+  for (int i = 1; i < n / 5; i++)
+    fprintf(out, "int v%d=v0; ", i);
+  fprintf(out, "return v0; }");
+}
+
+static void gen_blocks(FILE *out, int n) {
+  for (int i = 0; i < n / 2; i++)
+    fputc('{', out);
+  fprintf(out, "return 7;");
+  for (int i = 0; i < n / 2; i++)
+    fputc('}', out);
+}
+
+static void gen_parens(FILE *out, int n) {
+  fprintf(out, "{ return ");
+  for (int i = 0; i < n / 2; i++)
+    fputc('(', out);
+  fprintf(out, "42");
+  for (int i = 0; i < n / 2; i++)
+    fputc(')', out);
+  fprintf(out, "; }");
+}
+
+static void gen_plus(FILE *out, int n) {
+  fprintf(out, "{ return 1");
+  for (int i = 0; i < n / 2; i++)
+    fprintf(out, "+1");
+  fprintf(out, "; }");
+}
+
+static void gen_loops(FILE *out, int n) {
+  fprintf(out, "{ int s=0; int i=0; ");
+  for (int i = 0; i < n / 30; i++)
+    fprintf(out, "for (i=0; i<3; i=i+1) { s=s+i; } ");
+  fprintf(out, "return s; }");
+}
+
+static Generator generators[] = {
+    {"tokens", gen_tokens},
+    {"locals", gen_locals},
+    {"blocks", gen_blocks},
+    {"parens", gen_parens},
+    {"plus", gen_plus},
+    {"loops", gen_loops},
+};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long count_nodes(Node *root) {
+  long n = 0, len = 0, cap = 1024;
+  Node **stack = malloc(sizeof(Node *) * cap);
+  stack[len++] = root;
+  while (len) {
+    Node *node = stack[--len];
+    n++;
+    Node **children[] = NODE_CHILDREN(node);
+    for (int i = 0; i < NCHILDREN; i++) {
+      if (!*children[i])
+        continue;
+      if (len == cap)
+        stack = realloc(stack, sizeof(Node *) * (cap *= 2));
+      stack[len++] = *children[i];
+    }
+  }
+  free(stack);
+  return n;
+}
+
+// srcをREPEAT回コンパイルし、段階ごとに最短の時間を測る
+static Sample measure(char *src) {
+  Sample s = {.ok = true};
+  for (int i = 0; i < NPHASES; i++)
+    s.time[i] = INFINITY;
+
+  Compiler *cc = ccc_new();
+  FILE *out = fopen("/dev/null", "w");
+  for (int r = 0; r < REPEAT; r++) {
+    reset(cc);
+    cc->out = out;
+    if (setjmp(cc->jmpbuf)) {
+      fprintf(stderr, "%s", ccc_error(cc));
+      s.ok = false;
+      break;
+    }
+
+    double t0 = now();
+    Token *tok = tokenize(cc, src);
+    double t1 = now();
+    Function *prog = parse(cc, tok);
+    double t2 = now();
+    codegen(cc, prog);
+    fflush(out);
+    double t3 = now();
+
+    s.time[TOKENIZE] = fmin(s.time[TOKENIZE], t1 - t0);
+    s.time[PARSE] = fmin(s.time[PARSE], t2 - t1);
+    s.time[CODEGEN] = fmin(s.time[CODEGEN], t3 - t2);
+
+    if (r == 0) {
+      for (; tok; tok = tok->next)
+        s.tokens++;
+      s.nodes = count_nodes(prog->body);
+    }
+    arena_release(cc);
+  }
+  fclose(out);
+  ccc_free(cc);
+  return s;
+}
+
+// ピークのRSSを分けて測るため、子プロセスで生成してコンパイルする
+static bool run(Generator *g, int size, Result *res) {
+  int fd[2];
+  if (pipe(fd) < 0) {
+    perror("pipe");
+    exit(1);
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fd[0]);
+    char *src;
+    size_t len;
+    FILE *fp = open_memstream(&src, &len);
+    g->gen(fp, size);
+    fclose(fp);
+
+    Sample s = measure(src);
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    s.max_rss = ru.ru_maxrss;
+    if (write(fd[1], &len, sizeof(len)) != sizeof(len) ||
+        write(fd[1], &s, sizeof(s)) != sizeof(s))
+      _exit(1);
+    _exit(0);
+  }
+
+  close(fd[1]);
+  size_t len;
+  bool ok = read(fd[0], &len, sizeof(len)) == sizeof(len) &&
+            read(fd[0], &res->s, sizeof(res->s)) == sizeof(res->s);
+  close(fd[0]);
+
+  int status;
+  waitpid(pid, &status, 0);
+  if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || !res->s.ok)
+    return false;
+
+  res->gen = g->name;
+  res->size = size;
+  res->bytes = len;
+  return true;
+}
+
+static double total_time(Sample *s) {
+  double t = 0;
+  for (int i = 0; i < NPHASES; i++)
+    t += s->time[i];
+  return t;
+}
+
+// 同じ生成器で大きさが1/4の結果。なければNULL
+static Result *quarter(Result *res, int i) {
+  return i >= 2 && res[i - 2].gen == res[i].gen ? &res[i - 2] : NULL;
+}
+
+// aからbへの時間の伸びの指数。判定できなければ0
+static double growth(Result *a, Result *b, int phase) {
+  double ta = phase < 0 ? total_time(&a->s) : a->s.time[phase];
+  double tb = phase < 0 ? total_time(&b->s) : b->s.time[phase];
+  if (tb < MIN_JUDGE_TIME || ta <= 0)
+    return 0;
+  return log(tb / ta) / log((double)b->bytes / a->bytes);
+}
+
+// res[i]で段階phase(負なら全体)の時間が線形より速く伸びているか。
+// 1点だけでは測定の揺れで誤るので、1つ小さい大きさでも伸びていることを求める
+static bool superlinear(Result *res, int i, int phase) {
+  for (int j = i; j >= i - 1; j--) {
+    Result *q = quarter(res, j);
+    if (!q || q->gen != res[i].gen || growth(q, &res[j], phase) <= SUPERLINEAR)
+      return false;
+  }
+  return true;
+}
+
+static void print_json(FILE *out, Result *res, int n) {
+  fprintf(out, "{\n  \"version\": \"%s\",\n  \"results\": [", CCC_VERSION);
+  for (int i = 0; i < n; i++) {
+    Result *r = &res[i];
+    fprintf(out, "%s\n    {\"generator\": \"%s\", \"size\": %d, \"bytes\": %ld, "
+                 "\"tokens\": %ld, \"nodes\": %ld, \"max_rss_kb\": %ld, "
+                 "\"wall_sec\": %.6f, \"phases\": {",
+            i ? "," : "", r->gen, r->size, r->bytes, r->s.tokens, r->s.nodes,
+            r->s.max_rss, total_time(&r->s));
+    for (int p = 0; p < NPHASES; p++) {
+      // トークナイズとパースはトークン、コード生成はノードの処理速度
+      long items = p == CODEGEN ? r->s.nodes : r->s.tokens;
+      fprintf(out, "%s\"%s\": {\"wall_sec\": %.6f, \"%s_per_sec\": %.0f}",
+              p ? ", " : "", phase_names[p], r->s.time[p],
+              p == CODEGEN ? "nodes" : "tokens", items / r->s.time[p]);
+    }
+    fprintf(out, "}");
+    Result *q = quarter(res, i);
+    if (q) {
+      fprintf(out, ", \"growth\": {");
+      for (int p = 0; p < NPHASES; p++)
+        fprintf(out, "%s\"%s\": %.2f", p ? ", " : "", phase_names[p],
+                growth(q, r, p));
+      fprintf(out, "}");
+    }
+    fprintf(out, "}");
+  }
+  fprintf(out, "\n  ],\n  \"superlinear\": [");
+
+  int flagged = 0;
+  for (int i = 0; i < n; i++) {
+    for (int p = 0; p < NPHASES; p++) {
+      if (superlinear(res, i, p))
+        fprintf(out, "%s\n    {\"generator\": \"%s\", \"phase\": \"%s\", "
+                     "\"size\": %d, \"exponent\": %.2f}",
+                flagged++ ? "," : "", res[i].gen, phase_names[p], res[i].size,
+                growth(quarter(res, i), &res[i], p));
+    }
+  }
+  fprintf(out, "%s]\n}\n", flagged ? "\n  " : "");
+}
+
+int main(int argc, char **argv) {
+  char *output = "bench.json";
+  int ngens = sizeof(generators) / sizeof(*generators);
+  bool *selected = calloc(ngens, sizeof(bool));
+  bool any = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+      output = argv[++i];
+      continue;
+    }
+    int j = 0;
+    while (j < ngens && strcmp(argv[i], generators[j].name))
+      j++;
+    if (j == ngens) {
+      fprintf(stderr, "unknown generator: %s\n", argv[i]);
+      return 1;
+    }
+    selected[j] = any = true;
+  }
+
+  Result *res = NULL;
+  int n = 0, cap = 0;
+  bool slow = false;
+
+  printf("%-8s %8s %9s %9s %9s %9s %9s %10s %10s %s\n", "gen", "size",
+         "tokens", "nodes", "tokenize", "parse", "codegen", "Mtok/s",
+         "max_rss", "growth");
+  for (int g = 0; g < ngens; g++) {
+    if (any && !selected[g])
+      continue;
+    for (int size = MIN_SIZE; size <= MAX_SIZE; size *= 2) {
+      if (n == cap)
+        res = realloc(res, sizeof(Result) * (cap = cap ? cap * 2 : 64));
+      Result *r = &res[n];
+      if (!run(&generators[g], size, r)) {
+        fprintf(stderr, "%s: failed to compile size %d\n", generators[g].name,
+                size);
+        return 1;
+      }
+      n++;
+
+      Result *q = quarter(res, n - 1);
+      double k = q ? growth(q, r, -1) : 0;
+      bool flagged = false;
+      for (int p = 0; p < NPHASES; p++)
+        flagged |= superlinear(res, n - 1, p);
+      slow |= flagged;
+
+      printf("%-8s %8d %9ld %9ld %8.2fms %7.2fms %7.2fms %10.2f %8ldKB %.2f%s\n",
+             r->gen, size, r->s.tokens, r->s.nodes, r->s.time[TOKENIZE] * 1e3,
+             r->s.time[PARSE] * 1e3, r->s.time[CODEGEN] * 1e3,
+             r->s.tokens / total_time(&r->s) / 1e6, r->s.max_rss, k,
+             flagged ? "  SUPERLINEAR" : "");
+      fflush(stdout);
+
+      if (total_time(&r->s) > TIME_LIMIT)
+        break;
+    }
+  }
+
+  FILE *out = fopen(output, "w");
+  if (!out) {
+    perror(output);
+    return 1;
+  }
+  print_json(out, res, n);
+  fclose(out);
+  printf("results written to %s\n", output);
+  if (slow)
+    printf("superlinear growth detected\n");
+  return 0;
+}
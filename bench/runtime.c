@@ -0,0 +1,176 @@
+// 生成したコードの実行時間のベンチマーク
+//
+// 同じカーネルをCccとgcc -O0/-O2でコンパイルしたものを繰り返し実行し、
+// 最短の時間と、使えればperf_event_openでサイクル数と命令数を測る。
+// カーネルの表はbench/runtime.shが生成してリンクする。
+//
+//   runtime [-n ITERATIONS] [-o FILE]
+
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REPEAT 5
+
+enum { CCC, GCC_O0, GCC_O2, NVARIANTS };
+static char *variant_names[] = {"ccc", "gcc-O0", "gcc-O2"};
+
+typedef struct {
+  char *name;
+  int (*fn[NVARIANTS])(void);
+} Kernel;
+
+extern Kernel kernels[];
+extern int nkernels;
+
+typedef struct {
+  int result;
+  double time;  // 最短の時間 (秒)
+  long cycles;  // 測れなければ-1
+  long instrs;
+} Sample;
+
+// カーネルのループの回数。最適化で畳み込まれないように外から渡す
+static int iterations = 10000000;
+
+int n(void) { return iterations; }
+
+// サイクル数と命令数を1つのグループで数える
+static int perf_fd = -1;
+
+static int perf_open(uint64_t config, int group) {
+  struct perf_event_attr attr = {
+      .type = PERF_TYPE_HARDWARE,
+      .size = sizeof(attr),
+      .config = config,
+      .disabled = group < 0,
+      .exclude_kernel = 1,
+      .exclude_hv = 1,
+      .read_format = PERF_FORMAT_GROUP,
+  };
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static void perf_init(void) {
+  perf_fd = perf_open(PERF_COUNT_HW_CPU_CYCLES, -1);
+  if (perf_fd < 0)
+    return;
+  if (perf_open(PERF_COUNT_HW_INSTRUCTIONS, perf_fd) < 0) {
+    close(perf_fd);
+    perf_fd = -1;
+  }
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static Sample measure(int (*fn)(void)) {
+  Sample s = {.result = fn(), .time = 1e9, .cycles = -1, .instrs = -1};
+
+  for (int r = 0; r < REPEAT; r++) {
+    if (perf_fd >= 0) {
+      ioctl(perf_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+      ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    double t0 = now();
+    fn();
+    double t = now() - t0;
+
+    struct { uint64_t nr, values[2]; } counts = {};
+    if (perf_fd >= 0) {
+      ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+      if (read(perf_fd, &counts, sizeof(counts)) != sizeof(counts))
+        counts.nr = 0;
+    }
+
+    if (t < s.time) {
+      s.time = t;
+      if (counts.nr == 2) {
+        s.cycles = counts.values[0];
+        s.instrs = counts.values[1];
+      }
+    }
+  }
+  return s;
+}
+
+int main(int argc, char **argv) {
+  char *output = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      iterations = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+      output = argv[++i];
+    else {
+      fprintf(stderr, "usage: %s [-n ITERATIONS] [-o FILE]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  perf_init();
+  if (perf_fd < 0)
+    printf("perf_event_open is not available; cycles and instructions are not counted\n");
+
+  FILE *out = NULL;
+  if (output) {
+    out = fopen(output, "w");
+    if (!out) {
+      perror(output);
+      return 1;
+    }
+    fprintf(out, "{\n  \"iterations\": %d,\n  \"kernels\": [", iterations);
+  }
+
+  printf("%-10s %-7s %10s %14s %14s %6s %8s %8s\n", "kernel", "variant",
+         "time", "cycles", "instructions", "IPC", "vs -O0", "vs -O2");
+  bool mismatch = false;
+
+  for (int k = 0; k < nkernels; k++) {
+    Sample s[NVARIANTS];
+    for (int v = 0; v < NVARIANTS; v++)
+      s[v] = measure(kernels[k].fn[v]);
+
+    for (int v = 0; v < NVARIANTS; v++) {
+      printf("%-10s %-7s %8.2fms", kernels[k].name, variant_names[v],
+             s[v].time * 1e3);
+      if (s[v].cycles >= 0)
+        printf(" %14ld %14ld %6.2f", s[v].cycles, s[v].instrs,
+               (double)s[v].instrs / s[v].cycles);
+      else
+        printf(" %14s %14s %6s", "-", "-", "-");
+      printf(" %7.2fx %7.2fx%s\n", s[v].time / s[GCC_O0].time,
+             s[v].time / s[GCC_O2].time,
+             s[v].result != s[GCC_O0].result ? "  WRONG RESULT" : "");
+      mismatch |= s[v].result != s[GCC_O0].result;
+    }
+
+    if (out) {
+      fprintf(out, "%s\n    {\"name\": \"%s\", \"result\": %d",
+              k ? "," : "", kernels[k].name, s[GCC_O0].result);
+      for (int v = 0; v < NVARIANTS; v++)
+        fprintf(out, ", \"%s\": {\"time_sec\": %.6f, \"cycles\": %ld, "
+                     "\"instructions\": %ld}",
+                variant_names[v], s[v].time, s[v].cycles, s[v].instrs);
+      fprintf(out, ", \"slowdown_vs_O0\": %.3f, \"slowdown_vs_O2\": %.3f}",
+              s[CCC].time / s[GCC_O0].time, s[CCC].time / s[GCC_O2].time);
+    }
+  }
+
+  if (out) {
+    fprintf(out, "\n  ]\n}\n");
+    fclose(out);
+    printf("results written to %s\n", output);
+  }
+  return mismatch;
+}
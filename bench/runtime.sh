@@ -0,0 +1,84 @@
+#!/bin/bash
+# カーネルをCccとgcc -O0/-O2でコンパイルし、bench/runtime.cとリンクして
+# 実行時間を比べる。引数はそのまま実行ファイルに渡す。
+#
+#   bench/runtime.sh [-n ITERATIONS] [-o FILE]
+#
+# カーネルはCccが受け付ける複合文で、gccには関数の本体として渡す。
+# ループの回数はn()で受け取るので、gcc -O2でも畳み込まれない。
+# Cccの整数演算は溢れると折り返すので、gccには-fwrapvを付ける。
+
+cd "$(dirname "$0")/.."
+dir=tmp-bench
+rm -rf $dir
+mkdir $dir
+names=()
+
+kernel() {
+  name="$1"
+  body="$2"
+  names+=("$name")
+
+  ./Ccc --entry=${name}_ccc "$body" > $dir/$name.s || exit 1
+  as -o $dir/${name}_ccc.o $dir/$name.s || exit 1
+  for opt in O0 O2; do
+    printf 'int n(void);\nint %s_%s(void) %s\n' "$name" "$opt" "$body" |
+      gcc -$opt -fwrapv -xc -c -o $dir/${name}_$opt.o - || exit 1
+  done
+}
+
+kernel sum '{ int s=0; int m=n(); int i=0; for (i=0; i<m; i=i+1) s=s*31+i; return s; }'
+
+kernel pointer '{
+  int a=0; int b=1; int *p=&a; int *q=&b; int m=n(); int i=0;
+  while (i<m) { *p=*p+*q; *q=*q+i; i=i+1; }
+  return a;
+}'
+
+kernel nested '{
+  int s=0; int m=n()/1000; int i=0; int j=0;
+  for (i=0; i<1000; i=i+1)
+    for (j=0; j<m; j=j+1)
+      s=s+i*j-(i+j)/3;
+  return s;
+}'
+
+kernel arith '{
+  int x=1; int y=7; int m=n(); int i=0;
+  for (i=0; i<m; i=i+1) {
+    x=x*1103515245+12345;
+    y=y+x/65536-(x-y)*3;
+  }
+  return y;
+}'
+
+kernel branch '{
+  int c=0; int m=n()/100; int i=1;
+  while (i<m) {
+    int x=i;
+    while (x!=1) {
+      if (x/2*2==x) x=x/2; else x=3*x+1;
+      c=c+1;
+    }
+    i=i+1;
+  }
+  return c;
+}'
+
+# 呼び出し表を作る
+{
+  echo '#include <stddef.h>'
+  for name in "${names[@]}"; do
+    echo "int ${name}_ccc(void), ${name}_O0(void), ${name}_O2(void);"
+  done
+  echo 'typedef struct { char *name; int (*fn[3])(void); } Kernel;'
+  echo 'Kernel kernels[] = {'
+  for name in "${names[@]}"; do
+    echo "  {\"$name\", {${name}_ccc, ${name}_O0, ${name}_O2}},"
+  done
+  echo '};'
+  echo "int nkernels = ${#names[@]};"
+} > $dir/kernels.c
+
+gcc -O2 -o $dir/runtime bench/runtime.c $dir/kernels.c $dir/*_*.o || exit 1
+exec $dir/runtime "$@"
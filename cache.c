@@ -0,0 +1,469 @@
+// コンパイル結果のキャッシュ
+//
+// ソース、コンパイラ自身、コード生成のフラグのSHA-256をキーにして、
+// 生成したアセンブリやオブジェクトファイルをCCC_CACHE_DIRに保存する。
+// ヒットすればトークナイズもパースもコード生成もしない。
+//
+// エントリは一時ファイルに書いてからリネームするので、並行して動く
+// コンパイラが書きかけのエントリを読むことはない。ヒットするとmtimeを
+// 更新し、合計の大きさがCCC_CACHE_SIZEを超えたらmtimeの古い順に消す。
+// そのとき、異常終了したコンパイラが残した古い一時ファイルも消す。
+// ヒットとミスの回数はstatsファイルに足し込んでいく。
+//
+// コンパイラ自身のハッシュは、実行ファイルのinodeと大きさとmtimeと一緒に
+// self.idに覚えておき、実行ファイルが変わっていなければ読み直さない。
+
+#include "Ccc.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// キャッシュの大きさの上限のデフォルト
+#define DEFAULT_CACHE_SIZE (64 * 1024 * 1024)
+
+// これより古い一時ファイルは、書いていたコンパイラが異常終了した残りとみなす
+#define STALE_TMP_SEC 3600
+
+typedef struct {
+  uint32_t h[8];
+  uint8_t buf[64];
+  uint64_t len;
+} Sha256;
+
+char *cache_dir; // NULLならキャッシュは無効
+long cache_max_size;
+
+// まだstatsファイルに書いていない統計
+long cache_hits;
+long cache_misses;
+long cache_stored; // 書き込んだバイト数
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint8_t compiler_hash[32]; // コンパイラ自身の実行ファイルのハッシュ
+
+// self.idの中身。実行ファイルを見分ける情報とそのハッシュ
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  uint8_t hash[32];
+} SelfId;
+
+//
+// SHA-256 (FIPS 180-4)
+//
+
+const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+void sha256_init(Sha256 *s) {
+  static const uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                0x1f83d9ab, 0x5be0cd19};
+  memcpy(s->h, h, sizeof(h));
+  s->len = 0;
+}
+
+void sha256_block(Sha256 *s, uint8_t *p) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++)
+    w[i] = (uint32_t)p[i * 4] << 24 | p[i * 4 + 1] << 16 | p[i * 4 + 2] << 8 |
+           p[i * 4 + 3];
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3];
+  uint32_t e = s->h[4], f = s->h[5], g = s->h[6], h = s->h[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) +
+                  ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+    uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) +
+                  ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  s->h[0] += a;
+  s->h[1] += b;
+  s->h[2] += c;
+  s->h[3] += d;
+  s->h[4] += e;
+  s->h[5] += f;
+  s->h[6] += g;
+  s->h[7] += h;
+}
+
+void sha256_update(Sha256 *s, const void *data, size_t len) {
+  const uint8_t *p = data;
+  while (len > 0) {
+    int used = s->len % 64;
+    int n = 64 - used < len ? 64 - used : len;
+    memcpy(s->buf + used, p, n);
+    s->len += n;
+    p += n;
+    len -= n;
+    if (s->len % 64 == 0)
+      sha256_block(s, s->buf);
+  }
+}
+
+void sha256_final(Sha256 *s, uint8_t out[32]) {
+  uint64_t bits = s->len * 8;
+  uint8_t pad = 0x80;
+  sha256_update(s, &pad, 1);
+  pad = 0;
+  while (s->len % 64 != 56)
+    sha256_update(s, &pad, 1);
+
+  uint8_t buf[8];
+  for (int i = 0; i < 8; i++)
+    buf[i] = bits >> (56 - i * 8);
+  sha256_update(s, buf, 8);
+
+  for (int i = 0; i < 8; i++) {
+    out[i * 4] = s->h[i] >> 24;
+    out[i * 4 + 1] = s->h[i] >> 16;
+    out[i * 4 + 2] = s->h[i] >> 8;
+    out[i * 4 + 3] = s->h[i];
+  }
+}
+
+//
+// キャッシュ
+//
+
+// コンパイラが変わったら古いエントリを使わないよう、実行ファイルの
+// 中身のハッシュをcompiler_hashに求めてキーに含める。実行ファイルが
+// self.idに覚えたものと同じなら、そのハッシュを使う
+void hash_compiler(char *dir) {
+  SelfId id = {};
+  struct stat st;
+  bool known = stat("/proc/self/exe", &st) == 0;
+  if (known) {
+    id.dev = st.st_dev;
+    id.ino = st.st_ino;
+    id.size = st.st_size;
+    id.mtime = st.st_mtim;
+  }
+
+  char *path = format("%s/self.id", dir);
+  SelfId saved = {};
+  FILE *fp = known ? fopen(path, "r") : NULL;
+  if (fp) {
+    bool ok = fread(&saved, sizeof(saved), 1, fp) == 1;
+    fclose(fp);
+    if (ok && !memcmp(&saved, &id, offsetof(SelfId, hash))) {
+      memcpy(compiler_hash, saved.hash, 32);
+      free(path);
+      return;
+    }
+  }
+
+  Sha256 s;
+  sha256_init(&s);
+  sha256_update(&s, CCC_VERSION, strlen(CCC_VERSION));
+  fp = fopen("/proc/self/exe", "r");
+  if (fp) {
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+      sha256_update(&s, buf, n);
+    fclose(fp);
+  }
+  sha256_final(&s, compiler_hash);
+
+  // エントリと同じく、一時ファイルに書いてからリネームする
+  if (known) {
+    memcpy(id.hash, compiler_hash, 32);
+    char *tmp = format("%s/tmp.%d.%lx", dir, (int)getpid(),
+                       (unsigned long)pthread_self());
+    fp = fopen(tmp, "w");
+    if (fp) {
+      bool ok = fwrite(&id, sizeof(id), 1, fp) == 1;
+      if (fclose(fp) != 0 || !ok || rename(tmp, path) != 0)
+        remove(tmp);
+    }
+    free(tmp);
+  }
+  free(path);
+}
+
+// 環境変数からキャッシュの設定を読む。CCC_CACHE_DIRがなければ無効のまま
+void cache_init(void) {
+  char *dir = getenv("CCC_CACHE_DIR");
+  if (!dir || !*dir)
+    return;
+
+  if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+    fprintf(stderr, "cannot create %s\n", dir);
+    return;
+  }
+
+  char *size = getenv("CCC_CACHE_SIZE");
+  cache_max_size = size ? atol(size) : DEFAULT_CACHE_SIZE;
+
+  hash_compiler(dir);
+  cache_dir = dir;
+}
+
+// ソースとコード生成のフラグからキー(16進数64文字)を作る
+void cache_key(char *src, char *flags, char key[65]) {
+  Sha256 s;
+  sha256_init(&s);
+  sha256_update(&s, compiler_hash, 32);
+  sha256_update(&s, flags, strlen(flags) + 1);
+  sha256_update(&s, src, strlen(src));
+
+  uint8_t hash[32];
+  sha256_final(&s, hash);
+  for (int i = 0; i < 32; i++)
+    sprintf(key + i * 2, "%02x", hash[i]);
+}
+
+char *entry_path(char *key) { return format("%s/%s", cache_dir, key); }
+
+// キーに対応するエントリを返す。なければNULL
+char *cache_lookup(char *key, size_t *len) {
+  char *path = entry_path(key);
+  char *buf = NULL;
+
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0) {
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+      buf = malloc(st.st_size + 1);
+      if (read(fd, buf, st.st_size) == st.st_size) {
+        *len = st.st_size;
+        // 最近使ったことを記録する
+        futimens(fd, NULL);
+      } else {
+        free(buf);
+        buf = NULL;
+      }
+    }
+    close(fd);
+  }
+  free(path);
+
+  pthread_mutex_lock(&cache_lock);
+  if (buf)
+    cache_hits++;
+  else
+    cache_misses++;
+  pthread_mutex_unlock(&cache_lock);
+  return buf;
+}
+
+void cache_store(char *key, char *buf, size_t len) {
+  char *path = entry_path(key);
+  char *tmp = format("%s/tmp.%d.%lx", cache_dir, (int)getpid(),
+                     (unsigned long)pthread_self());
+
+  FILE *fp = fopen(tmp, "w");
+  if (fp) {
+    bool ok = fwrite(buf, 1, len, fp) == len;
+    ok = (fclose(fp) == 0) && ok;
+    if (ok && rename(tmp, path) == 0) {
+      pthread_mutex_lock(&cache_lock);
+      cache_stored += len;
+      pthread_mutex_unlock(&cache_lock);
+    } else {
+      remove(tmp);
+    }
+  }
+  free(tmp);
+  free(path);
+}
+
+// キャッシュを引き、ミスならcompileでコンパイルしてその結果をキャッシュに入れる
+int cached_compile(Compiler *cc, char *src, char *flags, CompileFn *compile,
+                   char **out, size_t *len) {
+  if (!cache_dir)
+    return compile(cc, src, out, len);
+
+  char key[65];
+  cache_key(src, flags, key);
+  *out = cache_lookup(key, len);
+  if (*out)
+    return 0;
+
+  if (compile(cc, src, out, len) != 0)
+    return -1;
+  cache_store(key, *out, *len);
+  return 0;
+}
+
+typedef struct {
+  char name[65];
+  long size;
+  struct timespec mtime;
+} Entry;
+
+int entry_cmp(const void *a, const void *b) {
+  const Entry *x = a, *y = b;
+  if (x->mtime.tv_sec != y->mtime.tv_sec)
+    return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+  if (x->mtime.tv_nsec != y->mtime.tv_nsec)
+    return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+  return 0;
+}
+
+// 最後に使われたのが古いエントリから消して、上限の9割まで減らす。
+// 古い一時ファイルも消す。残ったエントリの合計の大きさを返す
+long cache_evict(void) {
+  DIR *dir = opendir(cache_dir);
+  if (!dir)
+    return 0;
+
+  Entry *ents = NULL;
+  int len = 0, cap = 0;
+  long total = 0;
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  struct dirent *de;
+  while ((de = readdir(dir))) {
+    // 古い一時ファイルを消す
+    if (!strncmp(de->d_name, "tmp.", 4)) {
+      char *path = entry_path(de->d_name);
+      struct stat st;
+      if (stat(path, &st) == 0 && now.tv_sec - st.st_mtim.tv_sec > STALE_TMP_SEC)
+        unlink(path);
+      free(path);
+      continue;
+    }
+
+    if (strlen(de->d_name) != 64)
+      continue;
+
+    char *path = entry_path(de->d_name);
+    struct stat st;
+    if (stat(path, &st) == 0) {
+      if (len == cap) {
+        cap = cap ? cap * 2 : 64;
+        ents = realloc(ents, sizeof(Entry) * cap);
+      }
+      strcpy(ents[len].name, de->d_name);
+      ents[len].size = st.st_size;
+      ents[len].mtime = st.st_mtim;
+      total += st.st_size;
+      len++;
+    }
+    free(path);
+  }
+  closedir(dir);
+
+  if (total > cache_max_size) {
+    qsort(ents, len, sizeof(Entry), entry_cmp);
+    for (int i = 0; i < len && total > cache_max_size / 10 * 9; i++) {
+      char *path = entry_path(ents[i].name);
+      if (unlink(path) == 0)
+        total -= ents[i].size;
+      free(path);
+    }
+  }
+
+  free(ents);
+  return total;
+}
+
+// statsファイルの中身。"ヒット数 ミス数 合計の大きさ"の1行
+void read_stats(FILE *fp, long *hits, long *misses, long *size) {
+  *hits = *misses = *size = 0;
+  rewind(fp);
+  if (fscanf(fp, "%ld %ld %ld", hits, misses, size) != 3)
+    *hits = *misses = *size = 0;
+}
+
+// このプロセスの統計をstatsファイルに足し込む。
+// 上限を超えていたらついでにエビクションする
+void cache_flush_stats(void) {
+  if (!cache_dir)
+    return;
+
+  pthread_mutex_lock(&cache_lock);
+  long hits = cache_hits, misses = cache_misses, stored = cache_stored;
+  cache_hits = cache_misses = cache_stored = 0;
+  pthread_mutex_unlock(&cache_lock);
+  if (!hits && !misses && !stored)
+    return;
+
+  char *path = format("%s/stats", cache_dir);
+  int fd = open(path, O_RDWR | O_CREAT, 0666);
+  free(path);
+  if (fd < 0)
+    return;
+  FILE *fp = fdopen(fd, "r+");
+
+  // 並行して動く他のコンパイラと足し込みが混ざらないようにロックする
+  flock(fd, LOCK_EX);
+  long total_hits, total_misses, size;
+  read_stats(fp, &total_hits, &total_misses, &size);
+  total_hits += hits;
+  total_misses += misses;
+  size += stored;
+  if (size > cache_max_size)
+    size = cache_evict();
+
+  rewind(fp);
+  fprintf(fp, "%ld %ld %ld\n", total_hits, total_misses, size);
+  fflush(fp);
+  ftruncate(fd, ftell(fp));
+  flock(fd, LOCK_UN);
+  fclose(fp);
+}
+
+// --cache-stats
+int print_cache_stats(void) {
+  if (!cache_dir) {
+    fprintf(stderr, "CCC_CACHE_DIR is not set\n");
+    return 1;
+  }
+
+  long hits = 0, misses = 0, size = 0;
+  char *path = format("%s/stats", cache_dir);
+  FILE *fp = fopen(path, "r");
+  free(path);
+  if (fp) {
+    read_stats(fp, &hits, &misses, &size);
+    fclose(fp);
+  }
+
+  printf("hits %ld\n", hits);
+  printf("misses %ld\n", misses);
+  printf("size %ld\n", size);
+  printf("max_size %ld\n", cache_max_size);
+  return 0;
+}
@@ -1,221 +1,824 @@
 #include "Ccc.h"
 
-void gen_expr(Node *node);
+// 呼び出しのたびに書き換わらないことが保証される、関数の下の領域の大きさ
+#define RED_ZONE 128
 
-int labelCounter = 0;
-int depth;
+// 引数を渡すレジスタ
+static char *argreg64[] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
+static char *argreg32[] = {"%edi", "%esi", "%edx", "%ecx", "%r8d", "%r9d"};
 
-void push(void) {
-  printf("  push %%rax\n");
-  depth++;
+// 木をたどる途中の状態はFrameStackに積む。
+// 深く入れ子になった木でもC言語のスタックで再帰しないようにするため。
+void push_frame(FrameStack *s, Node *node, bool addr) {
+  if (s->len == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 64;
+    s->data = realloc(s->data, sizeof(Frame) * s->cap);
+  }
+  s->data[s->len++] = (Frame){node, addr};
+}
+
+// アセンブリを1行出力する
+void println(Compiler *cc, char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+
+  // 命令の種類は先頭だけ見ればわかる
+  if (cc->stats) {
+    char buf[80];
+    va_list ap2;
+    va_copy(ap2, ap);
+    vsnprintf(buf, sizeof(buf), fmt, ap2);
+    va_end(ap2);
+    count_insn(cc, buf);
+  }
+
+  vfprintf(cc->out, fmt, ap);
+  va_end(ap);
+  fprintf(cc->out, "\n");
+}
+
+// アセンブラの文字列リテラルとして出力する。
+// 表示できない文字はアセンブラが読める8進数のエスケープにする
+void print_asm_string(FILE *out, char *s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else if (c < 0x20 || c >= 0x7f)
+      fprintf(out, "\\%03o", c);
+    else
+      fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+// 変数のアドレスの基準になるレジスタ
+char *frame_reg(Compiler *cc) { return cc->leaf ? "%rsp" : "%rbp"; }
+
+// 葉関数では、一時的な値を変数の下のレッドゾーンに深さの順に置く
+int temp_offset(Compiler *cc) {
+  return -cc->cur_fn->stack_size - cc->depth * 8;
+}
+
+void push(Compiler *cc) {
+  cc->depth++;
+  if (cc->leaf)
+    println(cc, "  mov %%rax, %d(%%rsp)", temp_offset(cc));
+  else
+    println(cc, "  push %%rax");
+  if (cc->max_depth < cc->depth)
+    cc->max_depth = cc->depth;
+}
+
+void pop(Compiler *cc, char *arg) {
+  if (cc->leaf)
+    println(cc, "  mov %d(%%rsp), %s", temp_offset(cc), arg);
+  else
+    println(cc, "  pop %s", arg);
+  cc->depth--;
+}
+
+// RAXが指しているアドレスから値をロードする
+void load(Compiler *cc, Type *ty) {
+  if (ty->size == 4)
+    println(cc, "  movslq (%%rax), %%rax");
+  else
+    println(cc, "  mov (%%rax), %%rax");
+}
+
+// スタックトップのアドレスにRAXの値をストアする
+void store(Compiler *cc, Type *ty) {
+  pop(cc, "%rdi");
+  if (ty->size == 4)
+    println(cc, "  mov %%eax, (%%rdi)");
+  else
+    println(cc, "  mov %%rax, (%%rdi)");
 }
 
-void pop(char *arg) {
-  printf("  pop %s\n", arg);
-  depth--;
+// 4バイトの整数を8バイトの演算に使うときは符号拡張する
+void widen(Compiler *cc, Type *ty) {
+  if (ty->size == 4)
+    println(cc, "  movslq %%eax, %%rax");
 }
 
-void gen_addr(Node *node) {
+// RAXの値を0と比較する
+void cmp_zero(Compiler *cc, Type *ty) {
+  if (ty->size == 4)
+    println(cc, "  cmp $0, %%eax");
+  else
+    println(cc, "  cmp $0, %%rax");
+}
+
+// アドレス計算を1段階進める。完了したらtrueを返す
+bool addr_step(Compiler *cc, Node *node, int state) {
   switch (node->kind) {
   case ND_VAR:
-    printf("  lea %d(%%rbp), %%rax\n", node->var->offset);
-    return;
+    println(cc, "  lea %d(%s), %%rax", node->var->offset, frame_reg(cc));
+    return true;
   case ND_DEREF:
-    gen_expr(node->lhs);
-    return;
+    if (state == 0) {
+      push_frame(&cc->expr_frames, node->lhs, false);
+      return false;
+    }
+    return true;
   }
-  error("not an lvalue");
+  error(cc, "not an lvalue");
 }
 
-void gen_expr(Node *node) {
+// 式の評価を1段階進める。完了したらtrueを返す
+bool expr_step(Compiler *cc, Node *node, int state) {
   switch (node->kind) {
   case ND_NUM:
-    printf("  mov $%d, %%rax\n", node->val);
-    return;
+    println(cc, "  mov $%d, %%eax", node->val);
+    return true;
   case ND_NEG:
-    gen_expr(node->lhs);
-    printf("  neg %%rax\n");
-    return;
+    if (state == 0) {
+      push_frame(&cc->expr_frames, node->lhs, false);
+      return false;
+    }
+    if (node->ty->size == 4)
+      println(cc, "  neg %%eax");
+    else
+      println(cc, "  neg %%rax");
+    return true;
   case ND_VAR:
-    gen_addr(node);
-    printf("  mov (%%rax), %%rax\n");
-    return;
+    if (state == 0) {
+      push_frame(&cc->expr_frames, node, true);
+      return false;
+    }
+    load(cc, node->ty);
+    return true;
   case ND_DEREF:
-    gen_expr(node->lhs);
-    printf("  mov (%%rax), %%rax\n");
-    return;
+    if (state == 0) {
+      push_frame(&cc->expr_frames, node->lhs, false);
+      return false;
+    }
+    load(cc, node->ty);
+    return true;
   case ND_ADDR:
-    gen_addr(node->lhs);
-    return;
+    if (state == 0) {
+      push_frame(&cc->expr_frames, node->lhs, true);
+      return false;
+    }
+    return true;
   case ND_ASSIGN:
-    gen_addr(node->lhs);
-    push();
-    gen_expr(node->rhs);
-    pop("%rdi");
-    printf("  mov %%rax, (%%rdi)\n");
-    return;
-  case ND_FUNCALL:
-    printf("  mov $0, %%rax\n");
-    printf("  call %s\n", node->funcname);
-    return;
+    if (state == 0) {
+      push_frame(&cc->expr_frames, node->lhs, true);
+      return false;
+    }
+    if (state == 1) {
+      push(cc);
+      push_frame(&cc->expr_frames, node->rhs, false);
+      return false;
+    }
+    if (node->ty->size == 8)
+      widen(cc, node->rhs->ty);
+    store(cc, node->ty);
+    return true;
+  case ND_FUNCALL: {
+    // 引数を左から順に評価して積み、最後にまとめてレジスタに降ろす
+    int nargs = 0;
+    Node *arg = node->args;
+    for (; arg && nargs < state; arg = arg->next)
+      nargs++;
+    if (state > 0)
+      push(cc);
+    if (arg) {
+      push_frame(&cc->expr_frames, arg, false);
+      return false;
+    }
+    for (int i = nargs - 1; i >= 0; i--)
+      pop(cc, argreg64[i]);
+
+    // 呼び出し時のRSPは16バイト境界に揃える
+    if (cc->depth % 2)
+      println(cc, "  sub $8, %%rsp");
+    println(cc, "  mov $0, %%eax");
+    println(cc, "  call %s", node->funcname);
+    if (cc->depth % 2)
+      println(cc, "  add $8, %%rsp");
+    return true;
+  }
   }
 
-  gen_expr(node->rhs);
-  push();
-  gen_expr(node->lhs);
-  pop("%rdi");
+  // どちらかのオペランドがポインタなら64ビット、それ以外は32ビットで演算する
+  bool is_long = node->lhs->ty->size == 8 || node->rhs->ty->size == 8;
+  char *ax = is_long ? "%rax" : "%eax";
+  char *di = is_long ? "%rdi" : "%edi";
 
+  if (state == 0) {
+    push_frame(&cc->expr_frames, node->rhs, false);
+    return false;
+  }
+  if (state == 1) {
+    if (is_long)
+      widen(cc, node->rhs->ty);
+    push(cc);
+    push_frame(&cc->expr_frames, node->lhs, false);
+    return false;
+  }
+  if (is_long)
+    widen(cc, node->lhs->ty);
+  pop(cc, "%rdi");
   switch (node->kind) {
   case ND_ADD:
-    printf("  add %%rdi, %%rax\n");
-    return;
+    println(cc, "  add %s, %s", di, ax);
+    return true;
   case ND_SUB:
-    printf("  sub %%rdi, %%rax\n");
-    return;
+    println(cc, "  sub %s, %s", di, ax);
+    return true;
   case ND_MUL:
-    printf("  imul %%rdi, %%rax\n");
-    return;
+    println(cc, "  imul %s, %s", di, ax);
+    return true;
   case ND_DIV:
-    printf("  cqo\n");
-    printf("  idiv %%rdi\n");
-    return;
+    if (is_long)
+      println(cc, "  cqo");
+    else
+      println(cc, "  cltd");
+    println(cc, "  idiv %s", di);
+    return true;
   case ND_EQ:
   case ND_NE:
   case ND_LT:
   case ND_LE:
-    printf("  cmp %%rdi, %%rax\n");
+    println(cc, "  cmp %s, %s", di, ax);
 
     if (node->kind == ND_EQ) {
-      printf("  sete %%al\n");
+      println(cc, "  sete %%al");
     } else if (node->kind == ND_NE) {
-      printf("  setne %%al\n");
+      println(cc, "  setne %%al");
     } else if (node->kind == ND_LT) {
-      printf("  setl %%al\n");
+      println(cc, "  setl %%al");
     } else if (node->kind == ND_LE) {
-      printf("  setle %%al\n");
+      println(cc, "  setle %%al");
     }
-    printf("  movzb %%al, %%rax\n");
-    return;
+    println(cc, "  movzb %%al, %%eax");
+    return true;
   }
 
-  error("invalid expression");
+  error(cc, "invalid expression");
 }
 
-void gen_stmt(Node *node) {
+void gen_expr(Compiler *cc, Node *node) {
+  int base = cc->expr_frames.len;
+  push_frame(&cc->expr_frames, node, false);
+
+  while (cc->expr_frames.len > base) {
+    Frame *f = &cc->expr_frames.data[cc->expr_frames.len - 1];
+    int state = f->state++;
+    bool done = f->addr ? addr_step(cc, f->node, state) : expr_step(cc, f->node, state);
+    if (done)
+      cc->expr_frames.len--;
+  }
+}
+
+// "if (c) x = A; else x = B;"を分岐せずに実行する。cの副作用が先に起きるよう、
+// c、B、Aの順に評価してからcmovで選ぶ
+void gen_select(Compiler *cc, Node *node) {
+  Node *then, *els;
+  cmov_candidate(node, &then, &els);
+
+  gen_expr(cc, node->cond);
+  push(cc);
+  gen_expr(cc, els ? els->rhs : then->lhs);
+  push(cc);
+  gen_expr(cc, then->rhs);
+  pop(cc, "%rdi");
+  pop(cc, "%rsi");
+  if (node->cond->ty->size == 4)
+    println(cc, "  cmp $0, %%esi");
+  else
+    println(cc, "  cmp $0, %%rsi");
+  println(cc, "  cmove %%rdi, %%rax");
+  if (then->ty->size == 4)
+    println(cc, "  mov %%eax, %d(%s)", then->lhs->var->offset, frame_reg(cc));
+  else
+    println(cc, "  mov %%rax, %d(%s)", then->lhs->var->offset, frame_reg(cc));
+}
+
+// -gのとき、nodeのソース上の位置を出力する
+void emit_loc(Compiler *cc, Node *node) {
+  if (cc->debug_file && node->line_no)
+    println(cc, "  .loc 1 %d %d", node->line_no, node->col);
+}
+
+// 文のコード生成を1段階進める。完了したらtrueを返す
+bool stmt_step(Compiler *cc, Frame *f, int state) {
+  Node *node = f->node;
+  if (state == 0 && node->kind != ND_BLOCK)
+    emit_loc(cc, node);
+
   switch (node->kind) {
   case ND_IF: {
-    int counter = labelCounter++;
-    gen_expr(node->cond);
-    printf("  cmp $0, %%rax\n");
-    printf("  je  .L.else.%d\n", counter);
-    gen_stmt(node->then);
-    printf("  jmp .L.end.%d\n", counter);
-    printf(".L.else.%d:\n", counter);
-    if (node->els)
-      gen_stmt(node->els);
-    printf(".L.end.%d:\n", counter);
-    return;
+    if (state == 0) {
+      int counter = f->label = cc->labelCounter++;
+      f->layout = if_layout(cc, node);
+      if (f->layout == IF_CMOV) {
+        gen_select(cc, node);
+        return true;
+      }
+
+      gen_expr(cc, node->cond);
+      cmp_zero(cc, node->cond->ty);
+      if (f->layout == IF_COLD_THEN) {
+        println(cc, "  jne .L.then.%d", counter);
+        if (node->els)
+          push_frame(&cc->stmt_frames, node->els, false);
+        return false;
+      }
+      println(cc, "  je  .L.else.%d", counter);
+      count_edge(cc, node, 0);
+      push_frame(&cc->stmt_frames, node->then, false);
+      return false;
+    }
+
+    // 冷たい腕は関数の後ろに置き、終わったら.L.endに戻る
+    int counter = f->label;
+    if (f->layout == IF_COLD_THEN || f->layout == IF_COLD_ELSE) {
+      if (state == 1) {
+        println(cc, ".L.end.%d:", counter);
+        cc->out = cc->cold;
+        if (f->layout == IF_COLD_THEN) {
+          println(cc, ".L.then.%d:", counter);
+          push_frame(&cc->stmt_frames, node->then, false);
+        } else {
+          println(cc, ".L.else.%d:", counter);
+          push_frame(&cc->stmt_frames, node->els, false);
+        }
+        return false;
+      }
+      println(cc, "  jmp .L.end.%d", counter);
+      cc->out = cc->hot;
+      return true;
+    }
+
+    if (state == 1) {
+      println(cc, "  jmp .L.end.%d", counter);
+      println(cc, ".L.else.%d:", counter);
+      count_edge(cc, node, 1);
+      if (node->els) {
+        push_frame(&cc->stmt_frames, node->els, false);
+        return false;
+      }
+    }
+    println(cc, ".L.end.%d:", counter);
+    return true;
   }
   case ND_FOR:
   case ND_WHILE: {
-    int counter = labelCounter++;
-    if (node->init)
-      gen_expr(node->init);
-    printf(".L.begin.%d:\n", counter);
-    if (node->cond) {
-      gen_expr(node->cond);
-      printf("  cmp $0, %%rax\n");
-      printf("  je  .L.end.%d\n", counter);
-    }
-    gen_stmt(node->then);
+    if (state == 0) {
+      int counter = f->label = cc->labelCounter++;
+      f->copies = unroll_count(cc, node);
+      if (node->init)
+        gen_expr(cc, node->init);
+
+      // よく回るループは条件を末尾に置き、本体をcopies個並べる
+      if (f->copies) {
+        println(cc, "  jmp .L.cond.%d", counter);
+        println(cc, ".L.body.%d:", counter);
+        push_frame(&cc->stmt_frames, node->then, false);
+        return false;
+      }
+
+      count_edge(cc, node, 0);
+      println(cc, ".L.begin.%d:", counter);
+      if (node->cond) {
+        gen_expr(cc, node->cond);
+        cmp_zero(cc, node->cond->ty);
+        println(cc, "  je  .L.end.%d", counter);
+      }
+      count_edge(cc, node, 1);
+      push_frame(&cc->stmt_frames, node->then, false);
+      return false;
+    }
+    int counter = f->label;
+    emit_loc(cc, node);
     if (node->inc)
-      gen_expr(node->inc);
-    printf("  jmp .L.begin.%d\n", counter);
-    printf(".L.end.%d:\n", counter);
-    return;
+      gen_expr(cc, node->inc);
+
+    if (f->copies) {
+      if (--f->copies > 0) {
+        gen_expr(cc, node->cond);
+        cmp_zero(cc, node->cond->ty);
+        println(cc, "  je  .L.end.%d", counter);
+        push_frame(&cc->stmt_frames, node->then, false);
+        return false;
+      }
+      println(cc, ".L.cond.%d:", counter);
+      gen_expr(cc, node->cond);
+      cmp_zero(cc, node->cond->ty);
+      println(cc, "  jne .L.body.%d", counter);
+      println(cc, ".L.end.%d:", counter);
+      return true;
+    }
+
+    println(cc, "  jmp .L.begin.%d", counter);
+    println(cc, ".L.end.%d:", counter);
+    return true;
+  }
+  case ND_BLOCK: {
+    if (state == 0)
+      f->next = node->body;
+    Node *n = f->next;
+    if (!n)
+      return true;
+    f->next = n->next;
+    push_frame(&cc->stmt_frames, n, false);
+    return false;
   }
-  case ND_BLOCK:
-    for (Node *n = node->body; n; n = n->next)
-      gen_stmt(n);
-    return;
   case ND_RETURN:
-    gen_expr(node->lhs);
-    printf("  jmp .L.return\n");
-    return;
+    gen_expr(cc, node->lhs);
+    println(cc, "  jmp .L.return.%s", cc->cur_fn->name);
+    return true;
   case ND_EXPR_STMT:
-    gen_expr(node->lhs);
-    return;
+    gen_expr(cc, node->lhs);
+    return true;
   }
 
   switch (node->kind) {
   case ND_NUM:
-    error("ND_ADD");
+    error(cc, "ND_ADD");
     break;
   case ND_FOR:
-    error("ND_FOR");
+    error(cc, "ND_FOR");
     break;
   case ND_BLOCK:
-    error("ND_BLOCK");
+    error(cc, "ND_BLOCK");
     break;
   case ND_EXPR_STMT:
-    error("ND_EXPR_STMT");
+    error(cc, "ND_EXPR_STMT");
     break;
   case ND_RETURN:
-    error("ND_RETURN");
+    error(cc, "ND_RETURN");
     break;
   case ND_WHILE:
   case ND_IF:
-    error("stmt");
+    error(cc, "stmt");
     break;
   case ND_ASSIGN:
-    error("%d", node->rhs->val);
-    error("assign");
+    error(cc, "%d", node->rhs->val);
+    error(cc, "assign");
     break;
   case ND_VAR:
-    error("var");
+    error(cc, "var");
     break;
   default:
-    error("default");
+    error(cc, "default");
     break;
   }
 
-  error("invalid statement");
+  error(cc, "invalid statement");
+}
+
+void gen_stmt(Compiler *cc, Node *node) {
+  int base = cc->stmt_frames.len;
+  push_frame(&cc->stmt_frames, node, false);
+
+  while (cc->stmt_frames.len > base) {
+    Frame *f = &cc->stmt_frames.data[cc->stmt_frames.len - 1];
+    if (stmt_step(cc, f, f->state++))
+      cc->stmt_frames.len--;
+  }
 }
 
 // nを繰り上げ、alignの倍数で最も近い数を返す
 // align_to(5, 8) -> 8, align_to(11, 8)
 int align_to(int n, int align) { return (n + align - 1) / align * align; }
 
-void assign_lvar_offsets(Function *prog) {
-  int offset = 0;
+//
+// スタックフレームの割り当て
+//
+// 各変数の生存区間を文単位の位置で求め、区間が重ならない変数同士は
+// 同じスロットを共有する。
+//
+
+// 位置live_posで変数varが参照された。idxは宣言順の添字
+void touch_var(Compiler *cc, Obj *var, int idx) {
+  // 宣言を囲まない最も外側のループを探す。ループの外で宣言された変数は、
+  // 次の反復でも値が使われうるのでループ全体で生存させる。
+  int target = -1;
+  if (cc->open_len > 0) {
+    target = 0;
+    if (var->loop) {
+      for (int i = cc->open_len - 1; i >= 0; i--) {
+        if (cc->loops[cc->open_loops[i]].node == var->loop) {
+          target = i + 1 < cc->open_len ? i + 1 : -1;
+          break;
+        }
+      }
+    }
+  }
+
+  int start = cc->live_pos;
+  if (target >= 0) {
+    start = cc->loops[cc->open_loops[target]].lo;
+    cc->live_loop[idx] = cc->open_loops[target] + 1;
+  }
+
+  if (!var->live_start || start < var->live_start)
+    var->live_start = start;
+  if (var->live_end < cc->live_pos)
+    var->live_end = cc->live_pos;
+}
+
+void scan_expr(Compiler *cc, Node *node) {
+  if (!node)
+    return;
+
+  int base = cc->expr_frames.len;
+  push_frame(&cc->expr_frames, node, false);
+
+  while (cc->expr_frames.len > base) {
+    Node *n = cc->expr_frames.data[--cc->expr_frames.len].node;
+
+    if (n->kind == ND_VAR)
+      touch_var(cc, n->var, n->var->offset);
+
+    // アドレスを取られた変数はポインタ経由でいつ参照されるか分からないので、
+    // 関数全体で生存させる
+    if (n->kind == ND_ADDR && n->lhs->kind == ND_VAR) {
+      n->lhs->var->live_start = 1;
+      n->lhs->var->live_end = INT_MAX;
+    }
+
+    if (n->lhs)
+      push_frame(&cc->expr_frames, n->lhs, false);
+    if (n->rhs)
+      push_frame(&cc->expr_frames, n->rhs, false);
+    for (Node *arg = n->args; arg; arg = arg->next)
+      push_frame(&cc->expr_frames, arg, false);
+  }
+}
+
+// 文の生存区間の解析を1段階進める。完了したらtrueを返す
+bool scan_step(Compiler *cc, Frame *f, int state) {
+  Node *node = f->node;
+
+  switch (node->kind) {
+  case ND_IF:
+    if (state == 0) {
+      cc->live_pos++;
+      scan_expr(cc, node->cond);
+      push_frame(&cc->stmt_frames, node->then, false);
+      return false;
+    }
+    if (state == 1 && node->els) {
+      push_frame(&cc->stmt_frames, node->els, false);
+      return false;
+    }
+    return true;
+  case ND_FOR:
+  case ND_WHILE: {
+    if (state == 0) {
+      if (node->init) {
+        cc->live_pos++;
+        scan_expr(cc, node->init);
+      }
+
+      if (cc->loops_len == cc->loops_cap) {
+        cc->loops_cap = cc->loops_cap ? cc->loops_cap * 2 : 16;
+        cc->loops = realloc(cc->loops, sizeof(LoopRange) * cc->loops_cap);
+        cc->open_loops = realloc(cc->open_loops, sizeof(int) * cc->loops_cap);
+      }
+      int idx = f->label = cc->loops_len++;
+      cc->loops[idx] = (LoopRange){node, ++cc->live_pos, 0};
+      cc->open_loops[cc->open_len++] = idx;
+
+      scan_expr(cc, node->cond);
+      push_frame(&cc->stmt_frames, node->then, false);
+      return false;
+    }
+
+    if (node->inc) {
+      cc->live_pos++;
+      scan_expr(cc, node->inc);
+    }
+    cc->loops[f->label].hi = ++cc->live_pos;
+    cc->open_len--;
+    return true;
+  }
+  case ND_BLOCK: {
+    if (state == 0)
+      f->next = node->body;
+    Node *n = f->next;
+    if (!n)
+      return true;
+    f->next = n->next;
+    push_frame(&cc->stmt_frames, n, false);
+    return false;
+  }
+  case ND_RETURN:
+  case ND_EXPR_STMT:
+    cc->live_pos++;
+    scan_expr(cc, node->lhs);
+    return true;
+  }
+  return true;
+}
+
+void scan_stmt(Compiler *cc, Node *node) {
+  int base = cc->stmt_frames.len;
+  push_frame(&cc->stmt_frames, node, false);
+
+  while (cc->stmt_frames.len > base) {
+    Frame *f = &cc->stmt_frames.data[cc->stmt_frames.len - 1];
+    if (scan_step(cc, f, f->state++))
+      cc->stmt_frames.len--;
+  }
+}
+
+// サイズとアライメントの大きい順、同じなら生存区間の開始順に並べる
+int slot_order(const void *a, const void *b) {
+  Obj *x = *(Obj **)a;
+  Obj *y = *(Obj **)b;
+  if (x->ty->align != y->ty->align)
+    return y->ty->align - x->ty->align;
+  if (x->ty->size != y->ty->size)
+    return y->ty->size - x->ty->size;
+  if (x->live_start != y->live_start)
+    return x->live_start - y->live_start;
+  return x->offset - y->offset;
+}
+
+void assign_lvar_offsets(Compiler *cc, Function *prog) {
+  int nvars = 0;
+  for (Obj *var = prog->locals; var; var = var->next)
+    nvars++;
+
+  // 宣言順に並べる。解析中はoffsetに添字を入れておく
+  Obj **vars = arena_alloc(cc, sizeof(Obj *) * (nvars + 1));
+  int i = nvars;
   for (Obj *var = prog->locals; var; var = var->next) {
-    offset += 8;
-    var->offset = -offset;
+    vars[--i] = var;
+    var->offset = i;
+    var->live_start = var->live_end = 0;
+  }
+
+  cc->live_loop = arena_alloc(cc, sizeof(int) * (nvars + 1));
+  cc->loops_len = cc->open_len = cc->live_pos = 0;
+  scan_stmt(cc, prog->body);
+
+  // 参照される引数は関数の入口で値を受け取る
+  for (Obj *var = prog->params; var; var = var->next)
+    if (var->live_start)
+      var->live_start = 1;
+
+  for (i = 0; i < nvars; i++) {
+    if (!cc->live_loop[i])
+      continue;
+    LoopRange *l = &cc->loops[cc->live_loop[i] - 1];
+    if (vars[i]->live_start > l->lo)
+      vars[i]->live_start = l->lo;
+    if (vars[i]->live_end < l->hi)
+      vars[i]->live_end = l->hi;
+  }
+
+  // 一度も参照されない変数にはスロットを割り当てない
+  int n = 0;
+  for (i = 0; i < nvars; i++) {
+    if (vars[i]->live_start)
+      vars[n++] = vars[i];
+    else
+      vars[i]->offset = 0;
+  }
+  qsort(vars, n, sizeof(Obj *), slot_order);
+
+  // 同じサイズの変数ごとに、空いたスロットを先頭から再利用する。
+  // スロットはフレームの底から順に並べる。
+  Obj **slots = arena_alloc(cc, sizeof(Obj *) * (n + 1)); // スロットの最後の持ち主
+  int *slot_pos = arena_alloc(cc, sizeof(int) * (n + 1));
+  int nslots = 0;
+  int first = 0;
+  int offset = 0;
+  for (i = 0; i < n; i++) {
+    Obj *var = vars[i];
+    if (i > 0 && (vars[i - 1]->ty->size != var->ty->size ||
+                  vars[i - 1]->ty->align != var->ty->align))
+      first = nslots;
+
+    int s = first;
+    while (s < nslots && slots[s]->live_end >= var->live_start)
+      s++;
+    if (s == nslots) {
+      offset = align_to(offset, var->ty->align);
+      slot_pos[nslots++] = offset;
+      offset += var->ty->size;
+    }
+    slots[s] = var;
+    var->offset = slot_pos[s];
   }
   prog->stack_size = align_to(offset, 16);
+
+  for (i = 0; i < n; i++)
+    vars[i]->offset -= prog->stack_size;
 }
 
-void codegen(Function *prog) {
-  assign_lvar_offsets(prog);
+// 関数が何も呼ばず、変数と一時的な値がレッドゾーンに収まるならtrueを返す。
+// 式の評価で一時的な値を積む深さは、式のノードの数を超えない
+bool fits_red_zone(Function *fn) {
+  int slots = (RED_ZONE - fn->stack_size) / 8;
+  if (slots < 0)
+    return false;
+
+  int len = 0, cap = 64;
+  Node **stack = malloc(sizeof(Node *) * cap);
+  stack[len++] = fn->body;
+  bool ok = true;
 
-  // アセンブリの前半部分を出力
-  printf(".globl main\n");
-  printf("main:\n");
+  while (ok && len) {
+    Node *node = stack[--len];
+    if (node->kind == ND_FUNCALL)
+      ok = false;
 
-  // プロローグ
-  // 変数26個分の領域を確保する
-  printf("  push %%rbp\n");
-  printf("  mov %%rsp, %%rbp\n");
-  printf("  sub $%d, %%rsp\n", prog->stack_size);
+    // 文の中の式ごとに確かめる
+    Node *exprs[] = {node->cond, node->init, node->inc};
+    if (node->kind == ND_RETURN || node->kind == ND_EXPR_STMT)
+      exprs[0] = node->lhs;
+    for (int i = 0; i < 3; i++)
+      if (exprs[i] && count_nodes_upto(exprs[i], slots) > slots)
+        ok = false;
 
-  // コード生成
-  gen_stmt(prog->body);
-  assert(depth == 0);
+    Node **children[] = NODE_CHILDREN(node);
+    for (int i = 0; i < NCHILDREN; i++) {
+      if (!*children[i])
+        continue;
+      if (len == cap)
+        stack = realloc(stack, sizeof(Node *) * (cap *= 2));
+      stack[len++] = *children[i];
+    }
+  }
+  free(stack);
+  return ok;
+}
+
+void codegen(Compiler *cc, Function *prog) {
+  if (cc->debug_file) {
+    fprintf(cc->out, "  .file 1 ");
+    print_asm_string(cc->out, cc->debug_file);
+    fprintf(cc->out, "\n");
+  }
 
-  // エピローグ
-  // 最後の式の結果がRAXに残っているのでそれが返り値になる
-  printf(".L.return:\n");
-  printf("  mov %%rbp, %%rsp\n");
-  printf("  pop %%rbp\n");
-  printf("  ret\n");
+  for (Function *fn = prog; fn; fn = fn->next) {
+    trace_begin(cc, fn->name);
+    assign_lvar_offsets(cc, fn);
+    cc->cur_fn = fn;
+    if (cc->stats)
+      begin_fn_stats(cc, fn);
+    begin_pgo(cc, fn);
+
+    // アセンブリの前半部分を出力
+    println(cc, ".globl %s", fn->name);
+    println(cc, "%s:", fn->name);
+
+    // プロローグ
+    // CFIでフレームの形を示し、デバッガやプロファイラが巻き戻せるようにする。
+    // 葉関数はRSPを動かさず、変数と一時的な値をレッドゾーンに置く
+    println(cc, "  .cfi_startproc");
+    cc->leaf = fits_red_zone(fn);
+    if (!cc->leaf) {
+      println(cc, "  push %%rbp");
+      println(cc, "  .cfi_def_cfa_offset 16");
+      println(cc, "  .cfi_offset %%rbp, -16");
+      println(cc, "  mov %%rsp, %%rbp");
+      println(cc, "  .cfi_def_cfa_register %%rbp");
+      println(cc, "  sub $%d, %%rsp", fn->stack_size);
+    }
+
+    // レジスタで渡された引数を変数に書く
+    int i = 0;
+    for (Obj *var = fn->params; var; var = var->next, i++) {
+      if (!var->live_start)
+        continue;
+      if (var->ty->size == 4)
+        println(cc, "  mov %s, %d(%s)", argreg32[i], var->offset, frame_reg(cc));
+      else
+        println(cc, "  mov %s, %d(%s)", argreg64[i], var->offset, frame_reg(cc));
+    }
+
+    // コード生成
+    gen_stmt(cc, fn->body);
+    assert(cc->depth == 0);
+
+    // エピローグ
+    // 最後の式の結果がRAXに残っているのでそれが返り値になる
+    // retの後ろに置く冷たい腕はフレームの中にいるので、CFIを元に戻す
+    println(cc, ".L.return.%s:", fn->name);
+    if (cc->leaf) {
+      println(cc, "  ret");
+    } else {
+      println(cc, "  .cfi_remember_state");
+      println(cc, "  mov %%rbp, %%rsp");
+      println(cc, "  pop %%rbp");
+      println(cc, "  .cfi_def_cfa %%rsp, 8");
+      println(cc, "  ret");
+      println(cc, "  .cfi_restore_state");
+    }
+    flush_cold(cc);
+    println(cc, "  .cfi_endproc");
+    end_pgo(cc, fn);
+    if (cc->stats)
+      end_fn_stats(cc);
+    trace_end(cc);
+  }
 }
@@ -0,0 +1,179 @@
+#include "Ccc.h"
+
+// アリーナのブロックの大きさ
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+// コンパイル中に使うメモリを確保する。確保したメモリは0で初期化され、
+// コンパイルが終わるとまとめて解放される。
+void *arena_alloc(Compiler *cc, size_t size) {
+  size = (size + 7) / 8 * 8;
+  cc->alloc_count++;
+  cc->alloc_bytes += size;
+
+  Arena *a = cc->arena;
+  if (!a || a->cap - a->used < size) {
+    size_t cap = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    a = malloc(sizeof(Arena) + cap);
+    if (!a)
+      error(cc, "out of memory");
+    a->next = cc->arena;
+    a->used = 0;
+    a->cap = cap;
+    cc->arena = a;
+  }
+
+  void *p = a->data + a->used;
+  a->used += size;
+  memset(p, 0, size);
+  return p;
+}
+
+char *arena_strndup(Compiler *cc, char *p, size_t len) {
+  char *s = arena_alloc(cc, len + 1);
+  memcpy(s, p, len);
+  return s;
+}
+
+void arena_release(Compiler *cc) {
+  while (cc->arena) {
+    Arena *next = cc->arena->next;
+    free(cc->arena);
+    cc->arena = next;
+  }
+}
+
+Compiler *ccc_new(void) { return calloc(1, sizeof(Compiler)); }
+
+void ccc_free(Compiler *cc) {
+  if (!cc)
+    return;
+  arena_release(cc);
+  free(cc->errmsg);
+  free(cc->entry);
+  free(cc->stmt_stack);
+  free(cc->op_stack);
+  free(cc->operand_stack);
+  free(cc->type_stack);
+  free(cc->expr_frames.data);
+  free(cc->stmt_frames.data);
+  free(cc->loops);
+  free(cc->open_loops);
+  close_document(cc);
+  free_profile(cc->prof);
+  free_stats(cc->stats);
+  free(cc->pgo_path);
+  free(cc->debug_file);
+  free_pgo(cc->pgo);
+  free(cc->warnings);
+  free(cc);
+}
+
+void ccc_set_entry(Compiler *cc, const char *name) {
+  free(cc->entry);
+  cc->entry = name ? strdup(name) : NULL;
+}
+
+void ccc_set_debug_info(Compiler *cc, const char *file) {
+  free(cc->debug_file);
+  cc->debug_file = file ? strdup(file) : NULL;
+}
+
+// 前回のコンパイルの状態を捨てる。作業用のスタックは再利用する
+void reset(Compiler *cc) {
+  free(cc->errmsg);
+  cc->errmsg = NULL;
+  cc->user_input = NULL;
+  cc->token = NULL;
+  cc->locals = NULL;
+  cc->cur_loop = NULL;
+  cc->stmt_len = 0;
+  cc->op_len = 0;
+  cc->operand_len = 0;
+  cc->type_len = 0;
+  cc->cur_fn = NULL;
+  cc->labelCounter = 0;
+  cc->depth = 0;
+  cc->expr_frames.len = 0;
+  cc->stmt_frames.len = 0;
+  cc->loops_len = 0;
+  cc->open_len = 0;
+  cc->live_loop = NULL;
+  cc->max_depth = 0;
+  free(cc->warnings);
+  cc->warnings = NULL;
+  if (cc->cold) {
+    fclose(cc->cold);
+    free(cc->cold_buf);
+    cc->cold = NULL;
+    cc->cold_buf = NULL;
+  }
+  if (cc->prof)
+    cc->prof->spans_len = 0;
+  if (cc->stats)
+    clear_stats(cc->stats);
+}
+
+// ソースをコンパイルしてoutに書き出す。irならアセンブリの代わりにIRを書く
+int compile(Compiler *cc, const char *src, FILE *out, bool ir) {
+  reset(cc);
+  cc->out = out;
+
+  // エラーが起きるとここに戻ってくる
+  if (setjmp(cc->jmpbuf)) {
+    arena_release(cc);
+    return -1;
+  }
+
+  // トークナイズしてパースする
+  phase_begin(cc, "tokenize");
+  Token *tok = tokenize(cc, (char *)src);
+  phase_end(cc);
+  phase_begin(cc, "parse");
+  Function *prog = parse(cc, tok);
+  phase_end(cc);
+
+  // ASTからアセンブリかIRを出力する
+  phase_begin(cc, ir ? "write_ir" : "codegen");
+  if (ir)
+    write_ir(cc, prog, out);
+  else
+    codegen(cc, prog);
+  phase_end(cc);
+
+  arena_release(cc);
+  return 0;
+}
+
+int compile_to_buffer(Compiler *cc, const char *src, bool ir, char **out,
+                      size_t *len) {
+  FILE *fp = open_memstream(out, len);
+  if (!fp) {
+    free(cc->errmsg);
+    cc->errmsg = strdup("out of memory\n");
+    return -1;
+  }
+
+  int rc = compile(cc, src, fp, ir);
+  fclose(fp);
+
+  if (rc) {
+    free(*out);
+    *out = NULL;
+    *len = 0;
+  }
+  return rc;
+}
+
+int ccc_compile_file(Compiler *cc, const char *src, FILE *out) {
+  return compile(cc, src, out, false);
+}
+
+int ccc_compile(Compiler *cc, const char *src, char **out, size_t *len) {
+  return compile_to_buffer(cc, src, false, out, len);
+}
+
+int ccc_compile_ir(Compiler *cc, const char *src, char **out, size_t *len) {
+  return compile_to_buffer(cc, src, true, out, len);
+}
+
+const char *ccc_error(Compiler *cc) { return cc->errmsg; }
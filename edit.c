@@ -0,0 +1,377 @@
+// ソースの差分を解析し直す
+//
+// ccc_openで開いたソースについて、トップレベルの複合文の要素ごとに
+// ソース中の範囲と構文木を覚えておく。ccc_editでソースが書き換わったら、
+// 編集にかかる要素の範囲だけをトークナイズしてパースし直し、構文木に
+// つなぎ直す。それ以外の要素の構文木と型はそのまま使う。
+//
+// 変数の宣言が増えたり減ったりすると後ろの文の変数の解決が変わるので、
+// そのときやエラーがあったときは全体をパースし直す。
+//
+// 関数定義の並びのソースでは、関数定義を1つの要素にする。関数の変数は
+// ほかの関数から見えないので、編集にかかる関数だけをパースし直せばよい。
+
+#include "Ccc.h"
+
+// 古い構文木がこの倍数を超えて溜まったら、全体をパースし直して捨てる
+#define GARBAGE_RATIO 2
+
+size_t arena_size(Arena *a) {
+  size_t size = 0;
+  for (; a; a = a->next)
+    size += a->cap;
+  return size;
+}
+
+// 文書のarenaを使ってパースする。終わったらend_doc_arenaで戻す
+void begin_doc_arena(Compiler *cc) {
+  reset(cc);
+  cc->arena = cc->doc.arena;
+}
+
+void end_doc_arena(Compiler *cc) {
+  cc->doc.arena = cc->arena;
+  cc->arena = NULL;
+}
+
+TopItem *new_item(Document *doc, int i) {
+  if (doc->items_len == doc->items_cap) {
+    doc->items_cap = doc->items_cap ? doc->items_cap * 2 : 64;
+    doc->items = realloc(doc->items, sizeof(TopItem) * doc->items_cap);
+  }
+  memmove(doc->items + i + 1, doc->items + i,
+          sizeof(TopItem) * (doc->items_len - i));
+  doc->items_len++;
+  doc->items[i] = (TopItem){};
+  return &doc->items[i];
+}
+
+// 関数定義の並びのソースを、関数ごとに要素にしてパースする。
+// pはトークナイズしたソースの先頭で、cc->tokenはその最初のトークン
+int parse_functions(Compiler *cc, char *p) {
+  Document *doc = &cc->doc;
+  Function head = {};
+  Function *cur = &head;
+  while (cc->token->kind != TK_EOF) {
+    TopItem *item = new_item(doc, doc->items_len);
+    item->start = cc->token->loc - p;
+    item->fn = function(cc, head.next);
+    cur = cur->next = item->fn;
+  }
+  if (!head.next)
+    error_tok(cc, cc->token, "expected '{'");
+  check_calls(cc, head.next);
+  doc->body = NULL;
+  doc->body_end = doc->len;
+  doc->prog = head.next;
+
+  end_doc_arena(cc);
+  doc->full_size = arena_size(doc->arena);
+  doc->valid = true;
+  return 0;
+}
+
+// ソース全体をトークナイズしてパースし直す
+int parse_document(Compiler *cc) {
+  Document *doc = &cc->doc;
+  doc->valid = false;
+  doc->items_len = 0;
+
+  // 古い構文木を捨てる
+  begin_doc_arena(cc);
+  arena_release(cc);
+
+  if (setjmp(cc->jmpbuf)) {
+    end_doc_arena(cc);
+    return -1;
+  }
+
+  char *p = arena_strndup(cc, doc->src, doc->len);
+  cc->token = tokenize(cc, p);
+  if (!equal(cc->token, "{"))
+    return parse_functions(cc, p);
+  cc->token = cc->token->next;
+
+  doc->body = arena_alloc(cc, sizeof(Node));
+  doc->body->kind = ND_BLOCK;
+  Node *cur = NULL;
+
+  while (!equal(cc->token, "}")) {
+    TopItem *item = new_item(doc, doc->items_len);
+    item->start = cc->token->loc - p;
+    item->locals = cc->locals;
+    item->node = block_item(cc);
+    item->declares = cc->locals != item->locals;
+
+    if (cur)
+      cur->next = item->node;
+    else
+      doc->body->body = item->node;
+    cur = item->node;
+  }
+  doc->body_end = cc->token->loc - p;
+  cc->token = cc->token->next;
+  expect_eof(cc);
+
+  add_type(cc, doc->body);
+  doc->prog = arena_alloc(cc, sizeof(Function));
+  doc->prog->name = cc->entry ? cc->entry : "main";
+  doc->prog->body = doc->body;
+  doc->prog->locals = cc->locals;
+
+  end_doc_arena(cc);
+  doc->full_size = arena_size(doc->arena);
+  doc->valid = true;
+  return 0;
+}
+
+// 位置posを範囲に含む要素の添字
+int find_item(Document *doc, int pos) {
+  int lo = 0, hi = doc->items_len - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (doc->items[mid].start <= pos)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// 要素i..jを、新しいn個の要素itemsと入れ替える
+void replace_items(Document *doc, int i, int j, TopItem *items, int n) {
+  int old = j - i + 1;
+  if (n != old) {
+    int tail = doc->items_len - (j + 1);
+    if (doc->items_len - old + n > doc->items_cap) {
+      doc->items_cap = doc->items_len - old + n;
+      doc->items = realloc(doc->items, sizeof(TopItem) * doc->items_cap);
+    }
+    memmove(doc->items + i + n, doc->items + j + 1, sizeof(TopItem) * tail);
+    doc->items_len += n - old;
+  }
+  memcpy(doc->items + i, items, sizeof(TopItem) * n);
+}
+
+// 関数定義の並びで、[start, end)にある要素i..jの関数だけをパースし直す。
+// 戻り値はreparse_itemsと同じ
+int reparse_functions(Compiler *cc, int i, int j, int start, int end) {
+  Document *doc = &cc->doc;
+
+  begin_doc_arena(cc);
+  if (setjmp(cc->jmpbuf)) {
+    end_doc_arena(cc);
+    return -1;
+  }
+
+  char *p = arena_strndup(cc, doc->src + start, end - start);
+  cc->token = tokenize(cc, p);
+
+  int n = 0, cap = 0;
+  TopItem *items = NULL;
+  while (cc->token->kind != TK_EOF) {
+    int pos = start + (cc->token->loc - p);
+    Function *fn = function(cc, NULL);
+
+    if (n == cap) {
+      cap = cap ? cap * 2 : 8;
+      TopItem *buf = arena_alloc(cc, sizeof(TopItem) * cap);
+      memcpy(buf, items, sizeof(TopItem) * n);
+      items = buf;
+    }
+    items[n++] = (TopItem){.start = pos, .fn = fn};
+  }
+  end_doc_arena(cc);
+
+  // 関数がなくなるときは、全体をパースし直してエラーにする
+  if (doc->items_len - (j - i + 1) + n == 0)
+    return -1;
+  replace_items(doc, i, j, items, n);
+
+  // 関数のリストをつなぎ直す
+  Function *next = i + n < doc->items_len ? doc->items[i + n].fn : NULL;
+  for (int k = n - 1; k >= 0; k--) {
+    doc->items[i + k].fn->next = next;
+    next = doc->items[i + k].fn;
+  }
+  if (i > 0)
+    doc->items[i - 1].fn->next = next;
+  else
+    doc->prog = next;
+
+  // 名前が重なるか引数の数が合わなければ、全体をパースし直してエラーを報告する
+  for (Function *fn = doc->prog; fn; fn = fn->next)
+    if (find_function(fn->next, fn->name))
+      return -1;
+  if (setjmp(cc->jmpbuf))
+    return -1;
+  check_calls(cc, doc->prog);
+  return n;
+}
+
+// 編集後のソースで[start, end)にある要素i..jだけをパースし直し、
+// 新しい要素の数を返す。全体をパースし直す必要があれば-1を返す
+int reparse_items(Compiler *cc, int i, int j, int start, int end) {
+  Document *doc = &cc->doc;
+  if (!doc->body)
+    return reparse_functions(cc, i, j, start, end);
+
+  for (int k = i; k <= j; k++)
+    if (doc->items[k].declares)
+      return -1;
+
+  begin_doc_arena(cc);
+  if (setjmp(cc->jmpbuf)) {
+    end_doc_arena(cc);
+    return -1;
+  }
+
+  char *p = arena_strndup(cc, doc->src + start, end - start);
+  cc->token = tokenize(cc, p);
+  cc->locals = doc->items[i].locals;
+
+  // 新しい要素を作ってから古い要素i..jと入れ替える
+  int n = 0, cap = 0;
+  TopItem *items = NULL;
+  while (cc->token->kind != TK_EOF) {
+    int pos = start + (cc->token->loc - p);
+    Obj *locals = cc->locals;
+    Node *node = block_item(cc);
+    if (cc->locals != locals) {
+      end_doc_arena(cc);
+      return -1;
+    }
+    add_type(cc, node);
+
+    if (n == cap) {
+      cap = cap ? cap * 2 : 8;
+      TopItem *buf = arena_alloc(cc, sizeof(TopItem) * cap);
+      memcpy(buf, items, sizeof(TopItem) * n);
+      items = buf;
+    }
+    items[n++] = (TopItem){pos, node, locals, false};
+  }
+  end_doc_arena(cc);
+
+  replace_items(doc, i, j, items, n);
+
+  // 構文木をつなぎ直す
+  Node *next = i + n < doc->items_len ? doc->items[i + n].node : NULL;
+  Node *prev = i > 0 ? doc->items[i - 1].node : NULL;
+  for (int k = n - 1; k >= 0; k--) {
+    doc->items[i + k].node->next = next;
+    next = doc->items[i + k].node;
+  }
+  if (prev)
+    prev->next = next;
+  else
+    doc->body->body = next;
+  return n;
+}
+
+int ccc_open(Compiler *cc, const char *src) {
+  Document *doc = &cc->doc;
+  doc->len = strlen(src);
+  if (doc->cap < doc->len + 1) {
+    doc->cap = doc->len + 1;
+    doc->src = realloc(doc->src, doc->cap);
+  }
+  memcpy(doc->src, src, doc->len + 1);
+  return parse_document(cc);
+}
+
+int ccc_edit(Compiler *cc, size_t start, size_t end, const char *text) {
+  Document *doc = &cc->doc;
+  if (!doc->src || start > end || end > doc->len) {
+    free(cc->errmsg);
+    cc->errmsg = strdup("invalid edit range\n");
+    return -1;
+  }
+
+  // ソースを書き換える
+  int text_len = strlen(text);
+  int delta = text_len - (int)(end - start);
+  if (doc->cap < doc->len + delta + 1) {
+    doc->cap = (doc->len + delta + 1) * 2;
+    doc->src = realloc(doc->src, doc->cap);
+  }
+  memmove(doc->src + start + text_len, doc->src + end, doc->len - end + 1);
+  memcpy(doc->src + start, text, text_len);
+  doc->len += delta;
+
+  // 編集がトップレベルの要素の中に収まらなければ全体をパースし直す
+  if (!doc->valid || doc->items_len == 0 || (int)start < doc->items[0].start ||
+      (int)end > doc->body_end ||
+      arena_size(doc->arena) > doc->full_size * (GARBAGE_RATIO + 1))
+    return parse_document(cc);
+
+  // 編集範囲に接する要素までパースし直す。前の要素は";"か"}"で
+  // 終わるので、編集した文字がそのトークンとつながることはない
+  int i = find_item(doc, start);
+  int j = find_item(doc, end);
+  int old_end = j + 1 < doc->items_len ? doc->items[j + 1].start : doc->body_end;
+
+  int n = reparse_items(cc, i, j, doc->items[i].start, old_end + delta);
+  if (n < 0)
+    return parse_document(cc);
+
+  // 後ろの要素の位置をずらす
+  for (int k = i + n; k < doc->items_len; k++)
+    doc->items[k].start += delta;
+  doc->body_end += delta;
+  return 0;
+}
+
+int ccc_emit(Compiler *cc, char **out, size_t *len) {
+  Document *doc = &cc->doc;
+  if (!doc->valid) {
+    if (!doc->src) {
+      free(cc->errmsg);
+      cc->errmsg = strdup("no source is open\n");
+    }
+    return -1;
+  }
+
+  FILE *fp = open_memstream(out, len);
+  if (!fp) {
+    free(cc->errmsg);
+    cc->errmsg = strdup("out of memory\n");
+    return -1;
+  }
+
+  // コード生成が確保するメモリは文書とは別にして、すぐに解放する
+  reset(cc);
+  cc->out = fp;
+  cc->user_input = doc->src;
+
+  // 編集の前後で再利用した構文木の行番号はずれているので出力しない
+  char *debug_file = cc->debug_file;
+  cc->debug_file = NULL;
+  if (setjmp(cc->jmpbuf)) {
+    cc->debug_file = debug_file;
+    arena_release(cc);
+    fclose(fp);
+    free(*out);
+    *out = NULL;
+    *len = 0;
+    return -1;
+  }
+
+  codegen(cc, doc->prog);
+  cc->debug_file = debug_file;
+  arena_release(cc);
+  fclose(fp);
+  return 0;
+}
+
+void close_document(Compiler *cc) {
+  Document *doc = &cc->doc;
+  Arena *arena = cc->arena;
+  cc->arena = doc->arena;
+  arena_release(cc);
+  cc->arena = arena;
+
+  free(doc->src);
+  free(doc->items);
+  *doc = (Document){};
+}
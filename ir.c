@@ -0,0 +1,387 @@
+// 中間表現(IR)のシリアライズ
+//
+// 構文木をポインタの代わりに添字でつないだ平らな配列にして書き出す。
+// どのレコードも4バイトの整数だけからなり、各セクションはファイルの
+// 先頭からのオフセットで指すので、mmapしたファイルをそのまま読める。
+// 読み込みは配列を1回ずつなめて添字をポインタに直すだけで済む。
+//
+//   ヘッダ | 関数 | ノード | 変数 | 型 | 文字列表
+//
+// 添字の-1はNULLを表す。文字列は文字列表の中のオフセットで指す。
+// 整数はホストのバイト順(x86-64なのでリトルエンディアン)で書く。
+
+#include "Ccc.h"
+
+#include <stdint.h>
+
+#define IR_MAGIC "CCCIR"
+#define IR_VERSION 2
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t nfuncs;
+  uint32_t nnodes;
+  uint32_t nvars;
+  uint32_t ntypes;
+  uint32_t strtab_size;
+  uint32_t funcs; // 各セクションのファイル先頭からのオフセット
+  uint32_t nodes;
+  uint32_t vars;
+  uint32_t types;
+  uint32_t strtab;
+} IrHeader;
+
+typedef struct {
+  uint32_t name;
+  int32_t body;
+  int32_t locals; // 変数の添字。localsのリストの順に並んでいる
+  int32_t nlocals;
+  int32_t nparams; // localsの末尾のnparams個が引数
+} IrFunc;
+
+typedef struct {
+  uint32_t kind;
+  int32_t ty;
+  int32_t next;
+  int32_t lhs;
+  int32_t rhs;
+  int32_t cond;
+  int32_t then;
+  int32_t els;
+  int32_t init;
+  int32_t inc;
+  int32_t body;
+  int32_t args;
+  int32_t var;
+  int32_t val;
+  int32_t funcname; // 文字列表のオフセット。なければ-1
+} IrNode;
+
+// IrNodeの子のフィールドはNODE_CHILDRENと同じ順に並べる
+
+typedef struct {
+  uint32_t name;
+  int32_t ty;
+  int32_t loop;
+} IrVar;
+
+typedef struct {
+  uint32_t kind;
+  int32_t size;
+  int32_t align;
+  int32_t base;
+} IrType;
+
+//
+// 書き出し
+//
+
+// ポインタから添字を引く表
+typedef struct {
+  void *ptr;
+  int idx;
+} PtrIdx;
+
+typedef struct {
+  PtrIdx *data;
+  int len;
+  int cap;
+} PtrTable;
+
+void table_add(PtrTable *t, void *ptr, int idx) {
+  if (t->len == t->cap) {
+    t->cap = t->cap ? t->cap * 2 : 64;
+    t->data = realloc(t->data, sizeof(PtrIdx) * t->cap);
+  }
+  t->data[t->len++] = (PtrIdx){ptr, idx};
+}
+
+int ptr_cmp(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t)((PtrIdx *)a)->ptr;
+  uintptr_t y = (uintptr_t)((PtrIdx *)b)->ptr;
+  return x < y ? -1 : x > y;
+}
+
+void table_sort(PtrTable *t) { qsort(t->data, t->len, sizeof(PtrIdx), ptr_cmp); }
+
+int table_find(PtrTable *t, void *ptr) {
+  if (!ptr)
+    return -1;
+  PtrIdx key = {ptr};
+  PtrIdx *e = bsearch(&key, t->data, t->len, sizeof(PtrIdx), ptr_cmp);
+  assert(e);
+  return e->idx;
+}
+
+typedef struct {
+  char *buf;
+  size_t len;
+  FILE *fp;
+} StrTab;
+
+uint32_t add_string(StrTab *st, char *s) {
+  uint32_t off = ftell(st->fp);
+  fwrite(s, 1, strlen(s) + 1, st->fp);
+  return off;
+}
+
+// 型とその指す先の型を重複なく表に加える
+void add_types(PtrTable *types, Type *ty) {
+  for (; ty; ty = ty->base)
+    table_add(types, ty, 0);
+}
+
+void write_ir(Compiler *cc, Function *prog, FILE *out) {
+  int nfuncs = 0;
+  for (Function *fn = prog; fn; fn = fn->next)
+    nfuncs++;
+
+  // 関数の本体から幅優先でノードを並べる。子の添字は、親を処理する
+  // ときに子をキューに積んだ位置になる
+  Node **queue = malloc(sizeof(Node *) * nfuncs);
+  int qlen = 0, qcap = nfuncs;
+  for (Function *fn = prog; fn; fn = fn->next)
+    queue[qlen++] = fn->body;
+
+  PtrTable loops = {}, types = {}, vars = {};
+  for (int i = 0; i < qlen; i++) {
+    Node *node = queue[i];
+    if (node->kind == ND_WHILE || node->kind == ND_FOR)
+      table_add(&loops, node, i);
+    add_types(&types, node->ty);
+
+    Node **kids[] = NODE_CHILDREN(node);
+    for (int j = 0; j < NCHILDREN; j++) {
+      if (!*kids[j])
+        continue;
+      if (qlen == qcap) {
+        qcap *= 2;
+        queue = realloc(queue, sizeof(Node *) * qcap);
+      }
+      queue[qlen++] = *kids[j];
+    }
+  }
+
+  int nvars = 0;
+  for (Function *fn = prog; fn; fn = fn->next) {
+    for (Obj *var = fn->locals; var; var = var->next) {
+      table_add(&vars, var, nvars++);
+      add_types(&types, var->ty);
+    }
+  }
+
+  // 型の重複を除いて添字を振る
+  table_sort(&types);
+  int ntypes = 0;
+  for (int i = 0; i < types.len; i++) {
+    if (i > 0 && types.data[i].ptr == types.data[i - 1].ptr)
+      continue;
+    types.data[ntypes] = (PtrIdx){types.data[i].ptr, ntypes};
+    ntypes++;
+  }
+  types.len = ntypes;
+  table_sort(&loops);
+  table_sort(&vars);
+
+  StrTab st = {};
+  st.fp = open_memstream(&st.buf, &st.len);
+
+  IrHeader h = {IR_MAGIC, IR_VERSION, nfuncs, qlen, nvars, ntypes};
+  h.funcs = sizeof(IrHeader);
+  h.nodes = h.funcs + sizeof(IrFunc) * nfuncs;
+  h.vars = h.nodes + sizeof(IrNode) * qlen;
+  h.types = h.vars + sizeof(IrVar) * nvars;
+  h.strtab = h.types + sizeof(IrType) * ntypes;
+
+  IrFunc *funcs = calloc(nfuncs, sizeof(IrFunc));
+  int i = 0, v = 0;
+  for (Function *fn = prog; fn; fn = fn->next, i++) {
+    funcs[i].name = add_string(&st, fn->name);
+    funcs[i].body = i;
+    funcs[i].locals = v;
+    for (Obj *var = fn->locals; var; var = var->next)
+      funcs[i].nlocals++, v++;
+    for (Obj *var = fn->params; var; var = var->next)
+      funcs[i].nparams++;
+  }
+
+  IrNode *nodes = calloc(qlen, sizeof(IrNode));
+  int next = nfuncs; // 次にキューに積まれた子の添字
+  for (i = 0; i < qlen; i++) {
+    Node *node = queue[i];
+    IrNode *n = &nodes[i];
+    n->kind = node->kind;
+    n->ty = table_find(&types, node->ty);
+    n->var = table_find(&vars, node->var);
+    n->val = node->val;
+    n->funcname = node->funcname ? add_string(&st, node->funcname) : -1;
+
+    Node **kids[] = NODE_CHILDREN(node);
+    int32_t *slots = &n->next;
+    for (int j = 0; j < NCHILDREN; j++)
+      slots[j] = *kids[j] ? next++ : -1;
+  }
+
+  IrVar *irvars = calloc(nvars, sizeof(IrVar));
+  v = 0;
+  for (Function *fn = prog; fn; fn = fn->next) {
+    for (Obj *var = fn->locals; var; var = var->next, v++) {
+      irvars[v].name = add_string(&st, var->name);
+      irvars[v].ty = table_find(&types, var->ty);
+      irvars[v].loop = table_find(&loops, var->loop);
+    }
+  }
+
+  IrType *irtypes = calloc(ntypes, sizeof(IrType));
+  for (i = 0; i < ntypes; i++) {
+    Type *ty = types.data[i].ptr;
+    irtypes[i] = (IrType){ty->kind, ty->size, ty->align,
+                          table_find(&types, ty->base)};
+  }
+
+  fclose(st.fp);
+  h.strtab_size = st.len;
+
+  fwrite(&h, sizeof(h), 1, out);
+  fwrite(funcs, sizeof(IrFunc), nfuncs, out);
+  fwrite(nodes, sizeof(IrNode), qlen, out);
+  fwrite(irvars, sizeof(IrVar), nvars, out);
+  fwrite(irtypes, sizeof(IrType), ntypes, out);
+  fwrite(st.buf, 1, st.len, out);
+
+  free(queue);
+  free(loops.data);
+  free(types.data);
+  free(vars.data);
+  free(st.buf);
+  free(funcs);
+  free(nodes);
+  free(irvars);
+  free(irtypes);
+}
+
+//
+// 読み込み
+//
+
+// セクションがファイルに収まっているか確かめる
+void check_section(Compiler *cc, size_t len, uint32_t off, uint32_t n,
+                   size_t size) {
+  if (off % 4 || off > len || (len - off) / size < n)
+    error(cc, "broken IR: section out of range");
+}
+
+int32_t check_index(Compiler *cc, int32_t idx, uint32_t n) {
+  if (idx < -1 || idx >= (int64_t)n)
+    error(cc, "broken IR: index out of range");
+  return idx;
+}
+
+char *ir_string(Compiler *cc, IrHeader *h, char *strtab, uint32_t off) {
+  if (off >= h->strtab_size)
+    error(cc, "broken IR: string out of range");
+  return strtab + off;
+}
+
+// IRを読み込んで関数のリストを返す。文字列はbufの中を指すので、
+// bufはコンパイルが終わるまで有効でなければならない
+Function *read_ir(Compiler *cc, const void *buf, size_t len) {
+  IrHeader *h = (IrHeader *)buf;
+  if ((uintptr_t)buf % 4 || len < sizeof(IrHeader) ||
+      memcmp(h->magic, IR_MAGIC, sizeof(IR_MAGIC)))
+    error(cc, "not an IR module");
+  if (h->version != IR_VERSION)
+    error(cc, "unsupported IR version %u", h->version);
+
+  check_section(cc, len, h->funcs, h->nfuncs, sizeof(IrFunc));
+  check_section(cc, len, h->nodes, h->nnodes, sizeof(IrNode));
+  check_section(cc, len, h->vars, h->nvars, sizeof(IrVar));
+  check_section(cc, len, h->types, h->ntypes, sizeof(IrType));
+  check_section(cc, len, h->strtab, h->strtab_size, 1);
+
+  char *base = (char *)buf;
+  IrFunc *funcs = (IrFunc *)(base + h->funcs);
+  IrNode *irnodes = (IrNode *)(base + h->nodes);
+  IrVar *irvars = (IrVar *)(base + h->vars);
+  IrType *irtypes = (IrType *)(base + h->types);
+  char *strtab = base + h->strtab;
+  if (h->strtab_size && strtab[h->strtab_size - 1])
+    error(cc, "broken IR: unterminated string table");
+
+  Type *types = arena_alloc(cc, sizeof(Type) * h->ntypes);
+  for (int i = 0; i < h->ntypes; i++) {
+    IrType *t = &irtypes[i];
+    if (t->kind != TY_INT && t->kind != TY_PTR)
+      error(cc, "broken IR: unknown type");
+    int base = check_index(cc, t->base, h->ntypes);
+    types[i] = (Type){t->kind, t->size, t->align, base < 0 ? NULL : &types[base]};
+  }
+
+  Obj *vars = arena_alloc(cc, sizeof(Obj) * h->nvars);
+  Node *nodes = arena_alloc(cc, sizeof(Node) * h->nnodes);
+
+  // 子として指されるのは高々1回でなければ木にならない
+  char *used = arena_alloc(cc, h->nnodes);
+  for (int i = 0; i < h->nnodes; i++) {
+    IrNode *n = &irnodes[i];
+    Node *node = &nodes[i];
+    if (n->kind > ND_NUM)
+      error(cc, "broken IR: unknown node");
+    node->kind = n->kind;
+
+    int ty = check_index(cc, n->ty, h->ntypes);
+    int var = check_index(cc, n->var, h->nvars);
+    node->ty = ty < 0 ? NULL : &types[ty];
+    node->var = var < 0 ? NULL : &vars[var];
+    node->val = n->val;
+    if (n->funcname != -1)
+      node->funcname = ir_string(cc, h, strtab, n->funcname);
+
+    Node **kids[] = NODE_CHILDREN(node);
+    int32_t *slots = &n->next;
+    for (int j = 0; j < NCHILDREN; j++) {
+      int k = check_index(cc, slots[j], h->nnodes);
+      if (k < 0)
+        continue;
+      if (k <= i || used[k]++)
+        error(cc, "broken IR: not a tree");
+      *kids[j] = &nodes[k];
+    }
+  }
+
+  for (int i = 0; i < h->nvars; i++) {
+    IrVar *v = &irvars[i];
+    int ty = check_index(cc, v->ty, h->ntypes);
+    int loop = check_index(cc, v->loop, h->nnodes);
+    if (ty < 0)
+      error(cc, "broken IR: variable without a type");
+    vars[i].name = ir_string(cc, h, strtab, v->name);
+    vars[i].len = strlen(vars[i].name);
+    vars[i].ty = &types[ty];
+    vars[i].loop = loop < 0 ? NULL : &nodes[loop];
+  }
+
+  Function head = {};
+  Function *cur = &head;
+  for (int i = 0; i < h->nfuncs; i++) {
+    IrFunc *f = &funcs[i];
+    int body = check_index(cc, f->body, h->nnodes);
+    if (body < 0 || used[body]++ || f->locals < 0 || f->nlocals < 0 ||
+        f->locals > h->nvars || h->nvars - f->locals < f->nlocals ||
+        f->nparams < 0 || f->nparams > f->nlocals || f->nparams > MAX_ARGS)
+      error(cc, "broken IR: bad function");
+
+    Function *fn = cur = cur->next = arena_alloc(cc, sizeof(Function));
+    fn->name = ir_string(cc, h, strtab, f->name);
+    fn->body = &nodes[body];
+    for (int j = f->nlocals - 1; j >= 0; j--) {
+      Obj *var = &vars[f->locals + j];
+      var->next = fn->locals;
+      fn->locals = var;
+      if (j == f->nlocals - f->nparams)
+        fn->params = var;
+    }
+  }
+  return head.next;
+}
@@ -0,0 +1,92 @@
+// Cccをライブラリとして使うためのAPI
+#ifndef LIBCCC_H
+#define LIBCCC_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define CCC_VERSION "0.1"
+
+typedef struct Compiler Compiler;
+
+// コンパイラを作成する。失敗したらNULLを返す
+Compiler *ccc_new(void);
+
+// コンパイラを破棄する
+void ccc_free(Compiler *cc);
+
+// ソースをコンパイルし、アセンブリをoutに書き出す。
+// 成功なら0、エラーなら-1を返す。エラーの内容はccc_errorで取得できる。
+int ccc_compile_file(Compiler *cc, const char *src, FILE *out);
+
+// ソースをコンパイルし、アセンブリを新しく確保したバッファで返す。
+// *outはfreeで解放すること。成功なら0、エラーなら-1を返す。
+int ccc_compile(Compiler *cc, const char *src, char **out, size_t *len);
+
+// ソースをコンパイルし、アセンブリの代わりにIRのモジュールを返す。
+// *outはfreeで解放すること。成功なら0、エラーなら-1を返す。
+int ccc_compile_ir(Compiler *cc, const char *src, char **out, size_t *len);
+
+// n個のIRのモジュールをまとめて最適化し、アセンブリを返す。小さな関数の
+// インライン展開と定数の伝播をし、mainから呼ばれない関数を捨てる。
+// modules[i]はlens[i]バイトで、4バイト境界に置かれていること。
+int ccc_link(Compiler *cc, int n, const void **modules, const size_t *lens,
+             char **out, size_t *len);
+
+// 生成する関数の名前を設定する。NULLならmainに戻す
+void ccc_set_entry(Compiler *cc, const char *name);
+
+// 以後のコンパイルで、.fileと.locでソースの行番号と桁を出力する。
+// fileは.fileに書くソースの名前。NULLなら出力しない。
+// IRとccc_emitの出力には行番号を含めない。
+void ccc_set_debug_info(Compiler *cc, const char *file);
+
+// ソースを開き、以後の編集に備えてトークン列と構文木を保持する。
+// 成功なら0、エラーなら-1を返す。エラーがあってもソースは開いたままになる。
+int ccc_open(Compiler *cc, const char *src);
+
+// 開いているソースの[start, end)のバイトをtextで置き換え、編集にかかる
+// 文だけをトークナイズしてパースし直す。成功なら0、エラーなら-1を返す。
+int ccc_edit(Compiler *cc, size_t start, size_t end, const char *text);
+
+// 開いているソースのアセンブリを新しく確保したバッファで返す。
+// *outはfreeで解放すること。成功なら0、エラーなら-1を返す。
+int ccc_emit(Compiler *cc, char **out, size_t *len);
+
+// 以後のコンパイルで段階ごとの時間とメモリを計測する。
+// tidはトレースでのスレッド番号になる。
+void ccc_enable_profile(Compiler *cc, int tid);
+
+// srcの計測結果をdstに足し、srcのトレースを移す
+void ccc_merge_profile(Compiler *dst, Compiler *src);
+
+// 段階ごとの計測結果を表にしてoutに書き出す
+void ccc_time_report(Compiler *cc, FILE *out);
+
+// 計測した区間をChromeのトレースイベントの形式でoutに書き出す。
+// 成功なら0、書き込みに失敗したら-1を返す。
+int ccc_write_trace(Compiler *cc, FILE *out);
+
+// 以後のコンパイルで、生成した関数ごとに命令の数を種類別に数える
+void ccc_enable_stats(Compiler *cc);
+
+// 最後のコンパイルの統計を1関数1行のJSONでoutに書き出す。
+// fileがNULLでなければ各行に"file"として含める。
+void ccc_write_stats(Compiler *cc, const char *file, FILE *out);
+
+// 以後のコンパイルで、ifの腕とループを通った回数を数えるコードを埋め込む。
+// 生成したプログラムは終了時に回数をpathへ追記する。NULLなら埋め込まない。
+void ccc_set_profile_generate(Compiler *cc, const char *path);
+
+// 埋め込んだコードが書いたプロファイルを読み込み、以後のコード生成で
+// 分岐の配置、cmovの使用、ループの展開を決めるのに使う。
+// 成功なら0、形式が正しくなければ-1を返す。
+int ccc_set_profile_use(Compiler *cc, const void *data, size_t len);
+
+// 最後のコンパイルの警告を返す。なければNULL
+const char *ccc_warnings(Compiler *cc);
+
+// 最後のエラーメッセージを返す。エラーがなければNULL
+const char *ccc_error(Compiler *cc);
+
+#endif
@@ -0,0 +1,486 @@
+// リンク時最適化
+//
+// すべてのモジュールの関数を1つのリストにまとめてから、
+//   1. 定数式の畳み込みと、一度しか代入されない変数への定数の伝播
+//   2. 本体が小さな式をreturnするだけの関数の呼び出しのインライン展開。
+//      引数は数値か変数だけのときに、式の中の仮引数をそれで置き換える
+// を変化がなくなるまで繰り返し、最後にmainから呼ばれない関数を捨てる。
+// ノードは親から指されたまま書き換えるので、親へのポインタはいらない。
+
+#include "Ccc.h"
+
+#include <stdint.h>
+
+// インライン展開する式のノード数の上限
+#define INLINE_LIMIT 16
+
+// 最適化を繰り返す回数の上限。再帰呼び出しの展開もここで止まる
+#define MAX_ROUNDS 8
+
+typedef struct {
+  Node **data;
+  int len;
+  int cap;
+} NodeVec;
+
+void vec_push(NodeVec *v, Node *node) {
+  if (v->len == v->cap) {
+    v->cap = v->cap ? v->cap * 2 : 64;
+    v->data = realloc(v->data, sizeof(Node *) * v->cap);
+  }
+  v->data[v->len++] = node;
+}
+
+// rootの下のノードを、子が親より先に来る順に並べる
+void post_order(Node *root, NodeVec *out) {
+  NodeVec stack = {};
+  out->len = 0;
+  vec_push(&stack, root);
+  while (stack.len > 0) {
+    Node *node = stack.data[--stack.len];
+    vec_push(out, node);
+    Node **kids[] = NODE_CHILDREN(node);
+    for (int i = 0; i < NCHILDREN; i++)
+      if (*kids[i])
+        vec_push(&stack, *kids[i]);
+  }
+  free(stack.data);
+
+  for (int i = 0, j = out->len - 1; i < j; i++, j--) {
+    Node *tmp = out->data[i];
+    out->data[i] = out->data[j];
+    out->data[j] = tmp;
+  }
+}
+
+bool is_empty(Node *node) { return node->kind == ND_BLOCK && !node->body; }
+
+void make_num(Node *node, int val) {
+  node->kind = ND_NUM;
+  node->val = val;
+  node->lhs = node->rhs = NULL;
+  node->var = NULL;
+}
+
+void make_empty(Node *node) {
+  Node *next = node->next;
+  *node = (Node){ND_BLOCK};
+  node->next = next;
+}
+
+bool is_int_num(Node *node) {
+  return node && node->kind == ND_NUM && node->ty && node->ty->kind == TY_INT;
+}
+
+// 子がすべて処理済みのノードを1つ畳み込む。変化があればtrueを返す
+bool fold_node(Node *node) {
+  switch (node->kind) {
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE: {
+    if (!is_int_num(node->lhs) || !is_int_num(node->rhs) ||
+        node->ty->kind != TY_INT)
+      return false;
+
+    // 32ビットの演算として計算する
+    int32_t a = node->lhs->val, b = node->rhs->val;
+    int32_t v;
+    switch (node->kind) {
+    case ND_ADD: v = (uint32_t)a + (uint32_t)b; break;
+    case ND_SUB: v = (uint32_t)a - (uint32_t)b; break;
+    case ND_MUL: v = (uint32_t)a * (uint32_t)b; break;
+    case ND_DIV:
+      // 実行時の例外はそのまま残す
+      if (b == 0 || (a == INT32_MIN && b == -1))
+        return false;
+      v = a / b;
+      break;
+    case ND_EQ: v = a == b; break;
+    case ND_NE: v = a != b; break;
+    case ND_LT: v = a < b; break;
+    default: v = a <= b; break;
+    }
+    make_num(node, v);
+    return true;
+  }
+  case ND_NEG:
+    if (!is_int_num(node->lhs))
+      return false;
+    make_num(node, -(uint32_t)node->lhs->val);
+    return true;
+  case ND_IF: {
+    if (!is_int_num(node->cond))
+      return false;
+    Node *taken = node->cond->val ? node->then : node->els;
+    Node *next = node->next;
+    *node = (Node){ND_BLOCK};
+    node->body = taken;
+    node->next = next;
+    return true;
+  }
+  case ND_WHILE:
+  case ND_FOR:
+    if (!is_int_num(node->cond) || node->cond->val || node->init)
+      return false;
+    make_empty(node);
+    return true;
+  case ND_EXPR_STMT:
+    if (node->lhs->kind != ND_NUM)
+      return false;
+    make_empty(node);
+    return true;
+  case ND_BLOCK:
+    if (!node->body)
+      return false;
+    for (Node *n = node->body; n; n = n->next)
+      if (!is_empty(n))
+        return false;
+    node->body = NULL;
+    return true;
+  }
+  return false;
+}
+
+// 関数の本体で、上から順に必ず実行される代入文を集める
+void straight_line_assigns(Node *body, NodeVec *out) {
+  NodeVec blocks = {};
+  out->len = 0;
+  vec_push(&blocks, body);
+  while (blocks.len > 0) {
+    Node *block = blocks.data[--blocks.len];
+    for (Node *n = block->body; n; n = n->next) {
+      if (n->kind == ND_BLOCK)
+        vec_push(&blocks, n);
+      else if (n->kind == ND_EXPR_STMT && n->lhs->kind == ND_ASSIGN &&
+               n->lhs->lhs->kind == ND_VAR)
+        vec_push(out, n);
+    }
+  }
+  free(blocks.data);
+}
+
+// 一度しか代入されない変数に定数が代入されていれば、参照をその定数に
+// 置き換えて代入を消す。変化があればtrueを返す。
+// 宣言より前で変数を読むことはできず、未初期化の変数を読んだ結果は
+// 不定なので、必ず実行される代入より前の参照も置き換えてよい。
+// 変数のアドレスをずらして隣の変数を読み書きするプログラムもあるので、
+// どれかの変数のアドレスを取る関数では何もしない。
+bool propagate_constants(Compiler *cc, Function *fn, NodeVec *order) {
+  int nvars = 0;
+  for (Obj *var = fn->locals; var; var = var->next)
+    var->offset = nvars++;
+  if (nvars == 0)
+    return false;
+
+  // 解析中はoffsetに変数の添字を入れておく
+  int *nassign = arena_alloc(cc, sizeof(int) * nvars);
+  Node **def = arena_alloc(cc, sizeof(Node *) * nvars);
+
+  // 引数には呼び出し側で値が代入されている
+  for (Obj *var = fn->params; var; var = var->next)
+    nassign[var->offset]++;
+
+  for (int i = 0; i < order->len; i++) {
+    Node *n = order->data[i];
+    if (n->kind == ND_ASSIGN && n->lhs->kind == ND_VAR)
+      nassign[n->lhs->var->offset]++;
+    if (n->kind == ND_ADDR)
+      return false;
+  }
+
+  NodeVec assigns = {};
+  straight_line_assigns(fn->body, &assigns);
+  bool found = false;
+  for (int i = 0; i < assigns.len; i++) {
+    Node *stmt = assigns.data[i];
+    Obj *var = stmt->lhs->lhs->var;
+    if (nassign[var->offset] == 1 && var->ty->kind == TY_INT &&
+        is_int_num(stmt->lhs->rhs)) {
+      def[var->offset] = stmt;
+      found = true;
+    }
+  }
+  free(assigns.data);
+  if (!found)
+    return false;
+
+  for (int i = 0; i < order->len; i++) {
+    Node *n = order->data[i];
+    if (n->kind != ND_VAR || !def[n->var->offset])
+      continue;
+    Node *stmt = def[n->var->offset];
+    if (n != stmt->lhs->lhs)
+      make_num(n, stmt->lhs->rhs->val);
+  }
+  for (int i = 0; i < nvars; i++)
+    if (def[i])
+      make_empty(def[i]);
+  return true;
+}
+
+// 関数の中で畳み込みと定数の伝播を繰り返す。変化があればtrueを返す
+bool simplify(Compiler *cc, Function *fn) {
+  NodeVec order = {};
+  bool changed = false;
+
+  for (;;) {
+    post_order(fn->body, &order);
+    bool progress = false;
+    for (int i = 0; i < order.len; i++)
+      progress |= fold_node(order.data[i]);
+    progress |= propagate_constants(cc, fn, &order);
+    if (!progress)
+      break;
+    changed = true;
+  }
+
+  free(order.data);
+  return changed;
+}
+
+Function *find_function(Function *prog, char *name) {
+  for (Function *fn = prog; fn; fn = fn->next)
+    if (!strcmp(fn->name, name))
+      return fn;
+  return NULL;
+}
+
+// varがfnの仮引数なら、その番号。そうでなければ-1
+int param_index(Function *fn, Obj *var) {
+  int i = 0;
+  for (Obj *p = fn->params; p; p = p->next, i++)
+    if (p == var)
+      return i;
+  return -1;
+}
+
+// fnが小さな式をreturnするだけならその式を返す。式が読む変数は仮引数だけで、
+// 仮引数への代入やアドレスの取得はないこと。式に関数呼び出しがあれば
+// *has_callをtrueにする
+Node *inline_expr(Function *fn, bool *has_call) {
+  Node *stmt = fn->body->body;
+  while (stmt && is_empty(stmt))
+    stmt = stmt->next;
+  if (!stmt || stmt->kind != ND_RETURN)
+    return NULL;
+
+  NodeVec order = {};
+  post_order(stmt->lhs, &order);
+  bool ok = order.len <= INLINE_LIMIT;
+  *has_call = false;
+  for (int i = 0; ok && i < order.len; i++) {
+    Node *n = order.data[i];
+    if ((n->kind == ND_VAR && param_index(fn, n->var) < 0) ||
+        n->kind == ND_ASSIGN || n->kind == ND_ADDR ||
+        (n->kind == ND_FUNCALL && !strcmp(n->funcname, fn->name)))
+      ok = false;
+    *has_call |= n->kind == ND_FUNCALL;
+  }
+  free(order.data);
+  return ok ? stmt->lhs : NULL;
+}
+
+// 呼び出しnodeの引数を、calleeの仮引数の代わりに式へ埋め込めるか。
+// 引数は数値か変数で、仮引数と同じ数と型であること。変数は呼び出しの
+// 時点の値を読むので、式の中の関数呼び出しの後に読んではいけない
+bool substitutable(Node *node, Function *callee, bool has_call) {
+  Obj *param = callee->params;
+  for (Node *arg = node->args; arg; arg = arg->next, param = param->next) {
+    if (!param || !arg->ty || !param->ty || arg->ty->size != param->ty->size ||
+        is_integer(arg->ty) != is_integer(param->ty))
+      return false;
+    if (arg->kind != ND_NUM && (arg->kind != ND_VAR || has_call))
+      return false;
+  }
+  return !param;
+}
+
+// 式の木を複製する。calleeの仮引数を読むノードは、引数argsの対応する
+// ノードで置き換える
+Node *copy_expr(Compiler *cc, Node *expr, Function *callee, Node *args) {
+  Node *root = arena_alloc(cc, sizeof(Node));
+  NodeVec src = {}, dst = {};
+  vec_push(&src, expr);
+  vec_push(&dst, root);
+
+  while (src.len > 0) {
+    Node *s = src.data[--src.len];
+    Node *d = dst.data[--dst.len];
+    *d = *s;
+
+    int k = s->kind == ND_VAR ? param_index(callee, s->var) : -1;
+    if (k >= 0) {
+      Node *arg = args;
+      while (k--)
+        arg = arg->next;
+      *d = *arg;
+      d->next = s->next;
+    }
+
+    Node **skids[] = NODE_CHILDREN(s);
+    Node **dkids[] = NODE_CHILDREN(d);
+    for (int i = 0; i < NCHILDREN; i++) {
+      if (!*skids[i])
+        continue;
+      *dkids[i] = arena_alloc(cc, sizeof(Node));
+      vec_push(&src, *skids[i]);
+      vec_push(&dst, *dkids[i]);
+    }
+  }
+
+  free(src.data);
+  free(dst.data);
+  return root;
+}
+
+// fnの中の呼び出しをインライン展開する。変化があればtrueを返す
+bool inline_calls(Compiler *cc, Function *fn, Function *prog) {
+  NodeVec order = {};
+  post_order(fn->body, &order);
+
+  bool changed = false;
+  for (int i = 0; i < order.len; i++) {
+    Node *n = order.data[i];
+    if (n->kind != ND_FUNCALL)
+      continue;
+    Function *callee = find_function(prog, n->funcname);
+    bool has_call;
+    Node *expr = callee ? inline_expr(callee, &has_call) : NULL;
+    if (!expr || !substitutable(n, callee, has_call))
+      continue;
+
+    Node *next = n->next;
+    *n = *copy_expr(cc, expr, callee, n->args);
+    n->next = next;
+    changed = true;
+  }
+
+  free(order.data);
+  return changed;
+}
+
+// fnsのn個の関数のうち、名前がnameの関数の添字。なければ-1
+int function_index(Function **fns, int n, char *name) {
+  for (int k = 0; k < n; k++)
+    if (!strcmp(fns[k]->name, name))
+      return k;
+  return -1;
+}
+
+// mainから呼ばれうる関数だけを残す。mainがなければすべて残す
+Function *drop_unreferenced(Function *prog) {
+  int n = 0;
+  for (Function *fn = prog; fn; fn = fn->next)
+    n++;
+
+  Function **fns = malloc(sizeof(Function *) * n);
+  n = 0;
+  for (Function *fn = prog; fn; fn = fn->next)
+    fns[n++] = fn;
+
+  int root = function_index(fns, n, "main");
+  if (root < 0) {
+    free(fns);
+    return prog;
+  }
+
+  // 到達した関数の印。関数は添字で表す
+  bool *reached = calloc(n, sizeof(bool));
+  int *work = malloc(sizeof(int) * n);
+  int len = 0;
+  work[len++] = root;
+  reached[root] = true;
+
+  NodeVec order = {};
+  while (len > 0) {
+    Function *fn = fns[work[--len]];
+    post_order(fn->body, &order);
+    for (int i = 0; i < order.len; i++) {
+      Node *node = order.data[i];
+      if (node->kind != ND_FUNCALL)
+        continue;
+      int k = function_index(fns, n, node->funcname);
+      if (k >= 0 && !reached[k]) {
+        reached[k] = true;
+        work[len++] = k;
+      }
+    }
+  }
+  free(order.data);
+  free(work);
+
+  Function head = {};
+  Function *cur = &head;
+  for (int k = 0; k < n; k++)
+    if (reached[k])
+      cur = cur->next = fns[k];
+  cur->next = NULL;
+  free(reached);
+  free(fns);
+  return head.next;
+}
+
+Function *optimize_program(Compiler *cc, Function *prog) {
+  for (Function *fn = prog; fn; fn = fn->next)
+    if (find_function(fn->next, fn->name))
+      error(cc, "duplicate function: %s", fn->name);
+
+  for (int i = 0; i < MAX_ROUNDS; i++) {
+    for (Function *fn = prog; fn; fn = fn->next)
+      simplify(cc, fn);
+
+    bool changed = false;
+    for (Function *fn = prog; fn; fn = fn->next)
+      changed |= inline_calls(cc, fn, prog);
+    if (!changed)
+      break;
+  }
+
+  for (Function *fn = prog; fn; fn = fn->next)
+    simplify(cc, fn);
+  return drop_unreferenced(prog);
+}
+
+int ccc_link(Compiler *cc, int n, const void **modules, const size_t *lens,
+             char **out, size_t *len) {
+  reset(cc);
+  FILE *fp = open_memstream(out, len);
+  if (!fp)
+    return -1;
+  cc->out = fp;
+
+  if (setjmp(cc->jmpbuf)) {
+    arena_release(cc);
+    fclose(fp);
+    free(*out);
+    *out = NULL;
+    *len = 0;
+    return -1;
+  }
+
+  phase_begin(cc, "read_ir");
+  Function head = {};
+  Function *cur = &head;
+  for (int i = 0; i < n; i++) {
+    cur->next = read_ir(cc, modules[i], lens[i]);
+    while (cur->next)
+      cur = cur->next;
+  }
+  phase_end(cc);
+
+  phase_begin(cc, "optimize");
+  Function *prog = optimize_program(cc, head.next);
+  phase_end(cc);
+  phase_begin(cc, "codegen");
+  codegen(cc, prog);
+  phase_end(cc);
+
+  arena_release(cc);
+  fclose(fp);
+  return 0;
+}
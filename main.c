@@ -1,17 +1,593 @@
 #include "Ccc.h"
 
-int main(int argc, char **argv) {
-  if (argc != 2) {
-    error("引数の個数が正しくありません");
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// 入力ファイル1つ分のコンパイル
+typedef struct {
+  char *input;  // 入力ファイルのパス
+  char *output; // 出力ファイルのパス。"-"なら標準出力
+  char *asm_buf; // 標準出力に書くアセンブリ
+  size_t asm_len;
+  char *errmsg; // エラーメッセージ。成功ならNULL
+  char *stats_buf; // --statsで書く統計
+  size_t stats_len;
+} Unit;
+
+// コード生成のオプション
+char *entry;  // --entry=NAME。生成する関数の名前
+bool emit_ir; // -emit-ir。アセンブリの代わりにIRを出力する
+bool debug_info; // -g。行番号を出力する
+
+// 計測のオプション
+bool time_report; // --time-report
+char *trace_path; // --trace=FILE
+char *stats_path; // --stats=FILE
+Compiler *profile; // 各スレッドの計測結果を集める
+
+// プロファイルに基づく最適化のオプション
+char *profile_generate; // -fprofile-generate[=FILE]
+char *profile_use;      // -fprofile-use[=FILE]
+char *pgo_data;         // profile_useの内容
+size_t pgo_len;
+
+Unit *units;
+int nunits;
+int next_unit; // 次にコンパイルするユニット
+pthread_mutex_t unit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// ファイルの内容を読み込んで返す。"-"なら標準入力から読む
+char *read_file(char *path) {
+  FILE *fp;
+  if (strcmp(path, "-") == 0) {
+    fp = stdin;
+  } else {
+    fp = fopen(path, "r");
+    if (!fp)
+      return NULL;
+  }
+
+  char *buf;
+  size_t buflen;
+  FILE *out = open_memstream(&buf, &buflen);
+
+  for (;;) {
+    char buf2[4096];
+    int n = fread(buf2, 1, sizeof(buf2), fp);
+    if (n == 0)
+      break;
+    fwrite(buf2, 1, n, out);
+  }
+
+  if (fp != stdin)
+    fclose(fp);
+
+  fflush(out);
+  fputc('\0', out);
+  fclose(out);
+  return buf;
+}
+
+char *format(char *fmt, ...) {
+  char *buf;
+  size_t buflen;
+  FILE *out = open_memstream(&buf, &buflen);
+
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(out, fmt, ap);
+  va_end(ap);
+  fclose(out);
+  return buf;
+}
+
+bool endswith(char *p, char *q) {
+  int len1 = strlen(p);
+  int len2 = strlen(q);
+  return len1 >= len2 && !strcmp(p + len1 - len2, q);
+}
+
+// 入力ファイル名から出力ファイル名を作る。foo.c -> foo.s (-emit-irならfoo.ir)
+char *output_path(char *input) {
+  char *ext = emit_ir ? "ir" : "s";
+  if (endswith(input, ".c"))
+    return format("%.*s.%s", (int)strlen(input) - 2, input, ext);
+  return format("%s.%s", input, ext);
+}
+
+// 一時ファイルに書いてからリネームすることで、
+// 中途半端な出力が残らないようにする
+char *write_output(Unit *u, char *buf, size_t len) {
+  char *tmp = format("%s.tmp.%d", u->output, (int)getpid());
+  FILE *fp = fopen(tmp, "w");
+  if (!fp) {
+    free(tmp);
+    return format("cannot open %s\n", u->output);
+  }
+
+  bool ok = fwrite(buf, 1, len, fp) == len;
+  ok = (fclose(fp) == 0) && ok;
+  if (!ok || rename(tmp, u->output) != 0) {
+    remove(tmp);
+    free(tmp);
+    return format("cannot write %s\n", u->output);
+  }
+  free(tmp);
+  return NULL;
+}
+
+// オプションに従ってコンパイラを作る。tidは計測のスレッド番号
+Compiler *new_compiler(int tid) {
+  Compiler *cc = ccc_new();
+  if (profile)
+    ccc_enable_profile(cc, tid);
+  if (stats_path)
+    ccc_enable_stats(cc);
+  ccc_set_profile_generate(cc, profile_generate);
+  if (profile_use && ccc_set_profile_use(cc, pgo_data, pgo_len) != 0) {
+    fprintf(stderr, "%s: %s", profile_use, ccc_error(cc));
+    exit(1);
+  }
+  return cc;
+}
+
+// コード生成のオプションに従ってコンパイルする。キャッシュがあれば使う。
+// nameは-gで.fileに書くソースの名前
+int compile_source(Compiler *cc, char *name, char *src, char **buf,
+                   size_t *len) {
+  ccc_set_entry(cc, entry);
+  char *file = debug_info && !emit_ir ? name : NULL;
+  ccc_set_debug_info(cc, file);
+  char *flags = format("%s entry=%s%s%s%s%s", emit_ir ? "I" : "S",
+                       entry ? entry : "main",
+                       profile_generate ? " profile-generate=" : "",
+                       profile_generate ? profile_generate : "",
+                       file ? " g=" : "", file ? file : "");
+  int rc = cached_compile(cc, src, flags,
+                          emit_ir ? ccc_compile_ir : ccc_compile, buf, len);
+  free(flags);
+  if (ccc_warnings(cc))
+    fprintf(stderr, "%s", ccc_warnings(cc));
+  return rc;
+}
+
+void compile_unit(Compiler *cc, Unit *u) {
+  char *src = read_file(u->input);
+  if (!src) {
+    u->errmsg = format("cannot open %s\n", u->input);
+    return;
+  }
+
+  char *buf;
+  size_t len;
+  if (compile_source(cc, u->input, src, &buf, &len) != 0) {
+    u->errmsg = format("%s: %s", u->input, ccc_error(cc));
+    free(src);
+    return;
+  }
+  free(src);
+
+  if (stats_path) {
+    FILE *fp = open_memstream(&u->stats_buf, &u->stats_len);
+    ccc_write_stats(cc, u->input, fp);
+    fclose(fp);
+  }
+
+  // 標準出力への書き出しは、順序を保つため全部終わってから行う
+  if (strcmp(u->output, "-") == 0) {
+    u->asm_buf = buf;
+    u->asm_len = len;
+    return;
+  }
+
+  u->errmsg = write_output(u, buf, len);
+  free(buf);
+}
+
+// ワーカースレッド。ユニットを1つずつ取ってきてコンパイルする。
+// Compilerはスレッドごとに持つので、ユニット同士は状態を共有しない。
+void *worker(void *arg) {
+  Compiler *cc = new_compiler((int)(long)arg);
+
+  for (;;) {
+    pthread_mutex_lock(&unit_lock);
+    int i = next_unit++;
+    pthread_mutex_unlock(&unit_lock);
+    if (i >= nunits)
+      break;
+    compile_unit(cc, &units[i]);
+  }
+
+  if (profile) {
+    pthread_mutex_lock(&unit_lock);
+    ccc_merge_profile(profile, cc);
+    pthread_mutex_unlock(&unit_lock);
+  }
+  ccc_free(cc);
+  return NULL;
+}
+
+// 計測結果を--time-reportなら標準エラー出力に、--traceならファイルに書く
+int write_profile(Compiler *cc) {
+  if (time_report)
+    ccc_time_report(cc, stderr);
+  if (!trace_path)
+    return 0;
+
+  FILE *fp = fopen(trace_path, "w");
+  if (!fp) {
+    fprintf(stderr, "cannot open %s\n", trace_path);
+    return 1;
+  }
+  int rc = ccc_write_trace(cc, fp);
+  if (fclose(fp) != 0 || rc != 0) {
+    fprintf(stderr, "cannot write %s\n", trace_path);
     return 1;
   }
+  return 0;
+}
+
+// --statsの出力先を開く
+FILE *open_stats(void) {
+  FILE *fp = fopen(stats_path, "w");
+  if (!fp)
+    fprintf(stderr, "cannot open %s\n", stats_path);
+  return fp;
+}
+
+// 統計をファイルに書き、計測結果を書き出す
+int finish(Compiler *cc) {
+  if (stats_path) {
+    FILE *fp = open_stats();
+    if (!fp)
+      return 1;
+    ccc_write_stats(cc, NULL, fp);
+    fclose(fp);
+  }
+  return profile ? write_profile(cc) : 0;
+}
+
+void usage(int status) {
+  fprintf(stderr, "usage: Ccc [OPTIONS] PROGRAM\n"
+                  "       Ccc [OPTIONS] [-j N] [-o OUTPUT]... FILE.c...\n"
+                  "       Ccc --lto [OPTIONS] [-o OUTPUT] FILE.ir...\n"
+                  "       Ccc --server=SOCKET\n"
+                  "       Ccc --connect=SOCKET [-c] [-o OUTPUT] PROGRAM\n"
+                  "       Ccc --cache-stats\n"
+                  "       Ccc --edit=START,END,TEXT... PROGRAM\n"
+                  "options: --entry=NAME -emit-ir -g --time-report "
+                  "--trace=FILE --stats=FILE\n"
+                  "         -fprofile-generate[=FILE] -fprofile-use[=FILE]\n");
+  exit(status);
+}
+
+// --connect=SOCKET [-c] [-o OUTPUT] PROGRAM
+// サーバにプログラムを送ってコンパイルさせる。-cならオブジェクトファイルを返させる
+int client_main(int argc, char **argv) {
+  char *path = argv[1] + strlen("--connect=");
+  char kind = 'S';
+  char *output = "-";
+  char *input = NULL;
+
+  for (int i = 2; i < argc; i++) {
+    if (!strcmp(argv[i], "-c")) {
+      kind = 'O';
+      continue;
+    }
+    if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+      output = argv[++i];
+      continue;
+    }
+    if (input)
+      usage(1);
+    input = argv[i];
+  }
+  if (!input)
+    usage(1);
+
+  // "-"なら標準入力からプログラムを読む
+  if (strcmp(input, "-") == 0)
+    input = read_file(input);
+  return run_client(path, kind, input, output);
+}
 
-  // トークナイズしてパースする
-  Token *tok = tokenize(argv[1]);
-  Function *prog = parse(tok);
+// --edit=START,END,TEXT... PROGRAM
+// プログラムを開いてから編集を順に適用し、最後の結果をコンパイルする。
+// 編集のたびに変わった部分だけを解析し直す
+int edit_main(int argc, char **argv) {
+  char *input = argv[argc - 1];
+  if (strcmp(input, "-") == 0)
+    input = read_file(input);
 
-  // ASTからアセンブリを出力する
-  codegen(prog);
+  Compiler *cc = ccc_new();
+  ccc_open(cc, input);
 
+  for (int i = 1; i < argc - 1; i++) {
+    char *arg = argv[i];
+    if (strncmp(arg, "--edit=", 7))
+      usage(1);
+
+    char *p = arg + 7;
+    size_t start = strtoul(p, &p, 10);
+    if (*p++ != ',')
+      usage(1);
+    size_t end = strtoul(p, &p, 10);
+    if (*p++ != ',')
+      usage(1);
+
+    // 途中の編集でエラーになっても、後の編集で直ればよい
+    ccc_edit(cc, start, end, p);
+  }
+
+  char *buf;
+  size_t len;
+  if (ccc_emit(cc, &buf, &len) != 0) {
+    fprintf(stderr, "%s", ccc_error(cc));
+    return 1;
+  }
+  fwrite(buf, 1, len, stdout);
+  free(buf);
+  ccc_free(cc);
   return 0;
-}
\ No newline at end of file
+}
+
+// --lto: IRのモジュールをmmapで読み込み、まとめて最適化してから
+// 1つのアセンブリにする
+int link_main(char *output) {
+  const void **modules = calloc(nunits, sizeof(void *));
+  size_t *lens = calloc(nunits, sizeof(size_t));
+
+  for (int i = 0; i < nunits; i++) {
+    int fd = open(units[i].input, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      fprintf(stderr, "cannot open %s\n", units[i].input);
+      return 1;
+    }
+    lens[i] = st.st_size;
+    modules[i] = mmap(NULL, st.st_size ? st.st_size : 1, PROT_READ,
+                      MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (modules[i] == MAP_FAILED) {
+      fprintf(stderr, "cannot map %s\n", units[i].input);
+      return 1;
+    }
+  }
+
+  Compiler *cc = new_compiler(0);
+  char *buf;
+  size_t len;
+  if (ccc_link(cc, nunits, modules, lens, &buf, &len) != 0) {
+    fprintf(stderr, "%s", ccc_error(cc));
+    return 1;
+  }
+  if (ccc_warnings(cc))
+    fprintf(stderr, "%s", ccc_warnings(cc));
+
+  if (strcmp(output, "-") == 0) {
+    fwrite(buf, 1, len, stdout);
+  } else {
+    Unit u = {.output = output};
+    char *errmsg = write_output(&u, buf, len);
+    if (errmsg) {
+      fprintf(stderr, "%s", errmsg);
+      return 1;
+    }
+  }
+  free(buf);
+  int rc = finish(cc);
+  ccc_free(cc);
+  return rc;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "引数の個数が正しくありません\n");
+    usage(1);
+  }
+
+  // CCC_CACHE_DIRが設定されていればコンパイル結果をキャッシュする
+  cache_init();
+  atexit(cache_flush_stats);
+
+  if (!strcmp(argv[1], "--cache-stats"))
+    return print_cache_stats();
+  if (!strncmp(argv[1], "--server=", 9))
+    return run_server(argv[1] + 9);
+  if (!strncmp(argv[1], "--connect=", 10))
+    return client_main(argc, argv);
+  if (!strncmp(argv[1], "--edit=", 7))
+    return edit_main(argc, argv);
+
+  // コード生成のオプションを取り除く
+  bool lto = false;
+  int n = 1;
+  for (int i = 1; i < argc; i++) {
+    if (!strncmp(argv[i], "--entry=", 8))
+      entry = argv[i] + 8;
+    else if (!strcmp(argv[i], "-emit-ir"))
+      emit_ir = true;
+    else if (!strcmp(argv[i], "-g"))
+      debug_info = true;
+    else if (!strcmp(argv[i], "--lto"))
+      lto = true;
+    else if (!strcmp(argv[i], "--time-report"))
+      time_report = true;
+    else if (!strncmp(argv[i], "--trace=", 8))
+      trace_path = argv[i] + 8;
+    else if (!strncmp(argv[i], "--stats=", 8))
+      stats_path = argv[i] + 8;
+    else if (!strcmp(argv[i], "-fprofile-generate"))
+      profile_generate = "ccc.prof";
+    else if (!strncmp(argv[i], "-fprofile-generate=", 19))
+      profile_generate = argv[i] + 19;
+    else if (!strcmp(argv[i], "-fprofile-use"))
+      profile_use = "ccc.prof";
+    else if (!strncmp(argv[i], "-fprofile-use=", 14))
+      profile_use = argv[i] + 14;
+    else
+      argv[n++] = argv[i];
+  }
+  argv[n] = NULL; // 最後の-jや-oの引数を読んだときにNULLになるように
+  argc = n;
+  if (argc < 2)
+    usage(1);
+
+  // 計測するときはキャッシュを使わず、毎回コンパイルする
+  if (time_report || trace_path)
+    profile = ccc_new();
+  if (profile || stats_path)
+    cache_dir = NULL;
+
+  // プロファイルは内容がキャッシュのキーに含まれないので、キャッシュを使わない
+  if (profile_use) {
+    FILE *fp = fopen(profile_use, "r");
+    if (!fp) {
+      fprintf(stderr, "cannot open %s\n", profile_use);
+      return 1;
+    }
+    FILE *out = open_memstream(&pgo_data, &pgo_len);
+    char buf[4096];
+    int nread;
+    while ((nread = fread(buf, 1, sizeof(buf), fp)) > 0)
+      fwrite(buf, 1, nread, out);
+    fclose(fp);
+    fclose(out);
+    cache_dir = NULL;
+  }
+
+  // 引数が1つだけで、オプションでも.cファイルでもなければ、それをプログラム
+  // としてコンパイルし標準出力に書く。"-"なら標準入力からプログラムを読む
+  bool is_option = argv[1][0] == '-' && argv[1][1];
+  if (argc == 2 && !is_option && !endswith(argv[1], ".c") && !lto) {
+    char *input = argv[1];
+    char *name = "<command-line>";
+    if (strcmp(input, "-") == 0) {
+      input = read_file(input);
+      name = "<stdin>";
+    }
+
+    Compiler *cc = new_compiler(0);
+    char *buf;
+    size_t len;
+    if (compile_source(cc, name, input, &buf, &len) != 0) {
+      fprintf(stderr, "%s", ccc_error(cc));
+      return 1;
+    }
+
+    fwrite(buf, 1, len, stdout);
+    free(buf);
+    int rc = finish(cc);
+    ccc_free(cc);
+    return rc;
+  }
+
+  // ファイルをコンパイルする。N番目の-oはN番目の入力ファイルの出力先になる
+  int njobs = sysconf(_SC_NPROCESSORS_ONLN);
+  char **outputs = calloc(argc, sizeof(char *));
+  int noutputs = 0;
+  units = calloc(argc, sizeof(Unit));
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--help"))
+      usage(0);
+
+    if (!strncmp(argv[i], "-j", 2)) {
+      char *arg = argv[i][2] ? argv[i] + 2 : argv[++i];
+      if (!arg)
+        usage(1);
+      njobs = atoi(arg);
+      if (njobs < 1) {
+        fprintf(stderr, "invalid -j: %s\n", arg);
+        return 1;
+      }
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-o", 2)) {
+      char *arg = argv[i][2] ? argv[i] + 2 : argv[++i];
+      if (!arg)
+        usage(1);
+      outputs[noutputs++] = arg;
+      continue;
+    }
+
+    if (argv[i][0] == '-' && argv[i][1]) {
+      fprintf(stderr, "unknown argument: %s\n", argv[i]);
+      usage(1);
+    }
+
+    units[nunits++].input = argv[i];
+  }
+
+  if (nunits == 0) {
+    fprintf(stderr, "no input files\n");
+    return 1;
+  }
+  if (noutputs > nunits) {
+    fprintf(stderr, "more -o options than input files\n");
+    return 1;
+  }
+
+  if (lto) {
+    if (noutputs > 1) {
+      fprintf(stderr, "--lto takes at most one -o option\n");
+      return 1;
+    }
+    return link_main(noutputs ? outputs[0] : "-");
+  }
+
+  for (int i = 0; i < nunits; i++) {
+    units[i].output = i < noutputs ? outputs[i] : output_path(units[i].input);
+    for (int j = 0; j < i; j++) {
+      if (strcmp(units[i].output, "-") &&
+          !strcmp(units[i].output, units[j].output)) {
+        fprintf(stderr, "%s and %s both write to %s\n", units[j].input,
+                units[i].input, units[i].output);
+        return 1;
+      }
+    }
+  }
+
+  if (njobs > nunits)
+    njobs = nunits;
+
+  pthread_t *threads = calloc(njobs, sizeof(pthread_t));
+  for (int i = 0; i < njobs; i++) {
+    if (pthread_create(&threads[i], NULL, worker, (void *)(long)i) != 0) {
+      fprintf(stderr, "cannot create a thread\n");
+      return 1;
+    }
+  }
+  for (int i = 0; i < njobs; i++)
+    pthread_join(threads[i], NULL);
+
+  // 結果はスケジューリングによらず入力の順に報告する
+  int status = 0;
+  for (int i = 0; i < nunits; i++) {
+    if (units[i].errmsg) {
+      fprintf(stderr, "%s", units[i].errmsg);
+      status = 1;
+      continue;
+    }
+    if (units[i].asm_buf)
+      fwrite(units[i].asm_buf, 1, units[i].asm_len, stdout);
+  }
+  if (profile && write_profile(profile))
+    status = 1;
+
+  // 統計も入力の順に書く
+  if (stats_path) {
+    FILE *fp = open_stats();
+    if (!fp)
+      return 1;
+    for (int i = 0; i < nunits; i++)
+      if (units[i].stats_buf)
+        fwrite(units[i].stats_buf, 1, units[i].stats_len, fp);
+    fclose(fp);
+  }
+  return status;
+}
@@ -1,329 +1,345 @@
 #include "Ccc.h"
 
-Obj *locals;
-Token *token;
-
 // 変数を名前で検索する。見つからなかった場合はNULLを返す。
-Obj *find_lvar(Token *tok) {
-  for (Obj *var = locals; var; var = var->next)
-    if (strlen(var->name) == tok->len && !memcmp(tok->loc, var->name, var->len))
+Obj *find_lvar(Compiler *cc, Token *tok) {
+  for (Obj *var = cc->locals; var; var = var->next)
+    if (var->len == tok->len && !memcmp(tok->loc, var->name, var->len))
       return var;
   return NULL;
 }
 
-char *get_ident(Token *tok) {
+char *get_ident(Compiler *cc, Token *tok) {
   if (tok->kind != TK_IDENT)
-    error_tok(tok, "expected an identifier");
-  return strndup(tok->loc, tok->len);
+    error_tok(cc, tok, "expected an identifier");
+  return arena_strndup(cc, tok->loc, tok->len);
 }
 
 // Tokenが期待している記号のときには、Tokenを1つ読み進める。
 // それ以外の場合にはエラーを報告する。
-Token *skip(Token *tok, char *op) {
+Token *skip(Compiler *cc, Token *tok, char *op) {
   if (!equal(tok, op)) {
-    error_tok(tok, "expected '%s'", op);
+    error_tok(cc, tok, "expected '%s'", op);
   }
-  return token->next;
+  return tok->next;
 }
 
-bool consume(Token *tok, char *str) {
+bool consume(Compiler *cc, Token *tok, char *str) {
   if(equal(tok, str)) {
-    token = tok->next;
+    cc->token = tok->next;
     return true;
   }
   return false;
 }
 
-bool at_eof() { return token->kind == TK_EOF; }
+bool at_eof(Compiler *cc) { return cc->token->kind == TK_EOF; }
+
+// プログラムの終わりでなければエラーにする
+void expect_eof(Compiler *cc) {
+  if (!at_eof(cc))
+    error_tok(cc, cc->token, "extra token");
+}
 
-Node *new_node(NodeKind kind) {
-  Node *node = calloc(1, sizeof(Node));
+// ノードの位置はパース中のトークンの位置にする
+Node *new_node(Compiler *cc, NodeKind kind) {
+  Node *node = arena_alloc(cc, sizeof(Node));
   node->kind = kind;
+  node->line_no = cc->token->line_no;
+  node->col = cc->token->col;
   return node;
 }
 
-Node *new_binary(NodeKind kind, Node *lhs, Node *rhs) {
-  Node *node = new_node(kind);
+Node *new_binary(Compiler *cc, NodeKind kind, Node *lhs, Node *rhs) {
+  Node *node = new_node(cc, kind);
   node->lhs = lhs;
   node->rhs = rhs;
   return node;
 }
 
-Node *new_unary(NodeKind kind, Node *expr) {
-  Node *node = new_node(kind);
+Node *new_unary(Compiler *cc, NodeKind kind, Node *expr) {
+  Node *node = new_node(cc, kind);
   node->lhs = expr;
   return node;
 }
 
-Node *new_num_node(int val) {
-  Node *node = new_node(ND_NUM);
+Node *new_num_node(Compiler *cc, int val) {
+  Node *node = new_node(cc, ND_NUM);
   node->val = val;
   return node;
 }
 
-Node *new_var_node(Obj *var) {
-  Node *node = new_node(ND_VAR);
+Node *new_var_node(Compiler *cc, Obj *var) {
+  Node *node = new_node(cc, ND_VAR);
   node->var = var;
   return node;
 }
 
-Obj *new_lvar(char *name, Type *ty) {
-  Obj *var = calloc(1, sizeof(Obj));
+Obj *new_lvar(Compiler *cc, char *name, Type *ty) {
+  Obj *var = arena_alloc(cc, sizeof(Obj));
   var->name = name;
   var->ty = ty;
-  var->next = locals;
-  locals = var;
+  var->loop = cc->cur_loop;
+  var->next = cc->locals;
+  cc->locals = var;
   return var;
 }
 
-Node *declaration();
-Node *stmt();
-Node *compound_stmt();
-Node *expr_stmt();
-Node *expr();
-Node *assign();
-Node *equality();
-Node *relational();
-Node *add();
-Node *mul();
-Node *unary();
-Node *primary();
+Node *declaration(Compiler *cc);
+Node *stmt(Compiler *cc);
+Node *expr(Compiler *cc);
+Node *assign(Compiler *cc);
+Node *primary(Compiler *cc);
 
 // declspec = "int"
-Type *declspec() {
-  token = skip(token, "int");
+Type *declspec(Compiler *cc) {
+  cc->token = skip(cc, cc->token, "int");
   return ty_int;
 }
 
 // declarator = "*"* ident
-Type *declarator(Type *ty) {
-  while (consume(token, "*")) {
-    ty = pointer_to(ty);
+// 宣言された名前のトークンを*nameに入れる
+Type *declarator(Compiler *cc, Type *ty, Token **name) {
+  while (consume(cc, cc->token, "*")) {
+    ty = pointer_to(cc, ty);
   }
-  if (token->kind != TK_IDENT) {
-    error_tok(token, "expected a variable name");
+  if (cc->token->kind != TK_IDENT) {
+    error_tok(cc, cc->token, "expected a variable name");
   }
 
-  ty->name = token;
-  token = token->next;
+  *name = cc->token;
+  cc->token = cc->token->next;
   return ty;
 }
 
 // declaration = declspec (declarator ("=" expr)? ("," declarator ("=" expr)?)*)? ";"
-Node *declaration() {
-  Type *basety = declspec();
+Node *declaration(Compiler *cc) {
+  Type *basety = declspec(cc);
 
   Node head = {};
   Node *cur = &head;
   int i = 0;
 
-  while (!equal(token, ";")) {
+  while (!equal(cc->token, ";")) {
     if (i++ > 0) {
-      token = skip(token, ",");
+      cc->token = skip(cc, cc->token, ",");
     }
 
-    Type *ty = declarator(basety);
-    Obj *var = new_lvar(get_ident(ty->name), ty);
-    // Obj *var = new_lvar(get_ident(token), ty);
-    // Obj *var = new_lvar(token->loc, ty);
-    var->len = token->len;
+    Token *name;
+    Type *ty = declarator(cc, basety, &name);
+    Obj *var = new_lvar(cc, get_ident(cc, name), ty);
+    // Obj *var = new_lvar(cc, get_ident(cc, cc->token), ty);
+    // Obj *var = new_lvar(cc, cc->token->loc, ty);
+    var->len = name->len;
 
-    if (!equal(token, "=")) {
+    if (!equal(cc->token, "=")) {
       continue;
     }
-    token = skip(token, "=");
+    cc->token = skip(cc, cc->token, "=");
 
-    Node *lhs = new_var_node(var);
-    Node *rhs = assign();
-    Node *node = new_binary(ND_ASSIGN, lhs, rhs);
-    cur->next = new_unary(ND_EXPR_STMT, node);
+    Node *lhs = new_var_node(cc, var);
+    Node *rhs = assign(cc);
+    Node *node = new_binary(cc, ND_ASSIGN, lhs, rhs);
+    cur->next = new_unary(cc, ND_EXPR_STMT, node);
     cur = cur->next;
+    cur->line_no = name->line_no;
+    cur->col = name->col;
   }
 
-  Node *node = new_node(ND_BLOCK);
+  Node *node = new_node(cc, ND_BLOCK);
   node->body = head.next;
-  token = token->next;
+  cc->token = cc->token->next;
   return node;
 }
 
-// stmt = return" expr ";"
-//      | "{" compound-stmt
-//      | "if" "(" expr ")" stmt ( "else" stmt)?
-//      | "while" "(" expr ")" stmt
-//      | "for" "(" expr? ";" expr? ";" expr? ")" stmt
-//      | expr-stmt
-Node *stmt() {
-  if (equal(token, "return")) {
-    token = token->next;
-    Node *node = new_node(ND_RETURN);
-    node->lhs = expr();
-
-    token = skip(token, ";");
-    return node;
-  }
-
-  if (equal(token, "if")) {
-    token = token->next;
-    Node *node = new_node(ND_IF);
-    token = skip(token, "(");
-    node->cond = expr();
-    token = skip(token, ")");
-    node->then = stmt();
-    if (equal(token, "else")) {
-      token = token->next;
-      node->els = stmt();
-    }
-    return node;
-  }
-
-  if (equal(token, "while")) {
-    token = token->next;
-    Node *node = new_node(ND_WHILE);
-    token = skip(token, "(");
-    node->cond = expr();
-    token = skip(token, ")");
-    node->then = stmt();
-    return node;
+// expr-stmt = expr? ";"
+Node *expr_stmt(Compiler *cc) {
+  if (equal(cc->token, ";")) {
+    cc->token = cc->token->next;
+    return new_node(cc, ND_BLOCK);
   }
 
-  if (equal(token, "for")) {
-    token = token->next;
-    Node *node = new_node(ND_FOR);
-    token = skip(token, "(");
-    if (!equal(token, ";")) {
-      node->init = expr();
-    }
-    token = skip(token, ";");
-    if (!equal(token, ";")) {
-      node->cond = expr();
-    }
-    token = skip(token, ";");
-    if (!equal(token, ")")) {
-      node->inc = expr();
-    }
-    token = skip(token, ")");
-
-    node->then = stmt();
-    return node;
-  }
+  Node *node = new_node(cc, ND_EXPR_STMT);
+  node->lhs = expr(cc);
+  cc->token = skip(cc, cc->token, ";");
+  return node;
+}
 
-  if (equal(token, "{")) {
-    token = token->next;
-    return compound_stmt();
+//
+// 文のパース
+//
+// 入れ子になった文をC言語のスタックで再帰せずにパースするため、
+// パース途中の複合文やif/while/forを明示的なスタックに積む。
+//
+
+StmtFrame *push_stmt(Compiler *cc, Node *node) {
+  if (cc->stmt_len == cc->stmt_cap) {
+    cc->stmt_cap = cc->stmt_cap ? cc->stmt_cap * 2 : 64;
+    cc->stmt_stack = realloc(cc->stmt_stack, sizeof(StmtFrame) * cc->stmt_cap);
   }
+  StmtFrame *f = &cc->stmt_stack[cc->stmt_len++];
+  *f = (StmtFrame){node, NULL, NULL};
+  return f;
+}
 
-  return expr_stmt();
+// ブロックの末尾に文を追加する
+void block_append(StmtFrame *f, Node *node) {
+  if (f->cur)
+    f->cur->next = node;
+  else
+    f->node->body = node;
+  f->cur = node;
 }
 
-// compound-stmt = (declaration | stmt)* "}"
-Node *compound_stmt() {
-  Node head = {};
-  Node *cur = &head;
-  while (!equal(token, "}")) {
-    if (equal(token, "int")) {
-      cur->next = declaration();
-      cur = cur->next;
-    } else {
-      cur->next = stmt();
-      cur = cur->next;
+// 複合文の中の宣言を読み進める。
+// "}"でブロックが閉じたらtrue、次が文ならfalseを返す。
+bool block_continue(Compiler *cc, StmtFrame *f) {
+  for (;;) {
+    if (equal(cc->token, "}")) {
+      cc->token = cc->token->next;
+      return true;
     }
+    if (!equal(cc->token, "int"))
+      return false;
+    block_append(f, declaration(cc));
   }
-  token = skip(token, "}");
-
-  Node *node = new_node(ND_BLOCK);
-  node->body = head.next;
-  return node;
 }
 
-// expr-stmt = expr? ";"
-Node *expr_stmt() {
-  if (equal(token, ";")) {
-    token = token->next;
-    return new_node(ND_BLOCK);
-  }
-
-  Node *node = new_unary(ND_EXPR_STMT, expr());
-  token = skip(token, ";");
-  return node;
-}
+// 文の先頭をパースする。子の文を持たない文はそのまま返し、
+// 子の文を持つ文はスタックに積んでNULLを返す。
+Node *stmt_head(Compiler *cc) {
+  if (equal(cc->token, "return")) {
+    Node *node = new_node(cc, ND_RETURN);
+    cc->token = cc->token->next;
+    node->lhs = expr(cc);
 
-// expr = assign
-Node *expr() { return assign(); }
+    cc->token = skip(cc, cc->token, ";");
+    return node;
+  }
 
-// assign = equality ("=" assign)?
-Node *assign() {
-  Node *node = equality();
-  if (equal(token, "=")) {
-    token = token->next;
-    node = new_binary(ND_ASSIGN, node, assign());
+  if (equal(cc->token, "if")) {
+    Node *node = new_node(cc, ND_IF);
+    cc->token = cc->token->next;
+    cc->token = skip(cc, cc->token, "(");
+    node->cond = expr(cc);
+    cc->token = skip(cc, cc->token, ")");
+    push_stmt(cc, node);
+    return NULL;
   }
-  return node;
-}
 
-// equality = relational ("==" relational | "!=" relational)*
-Node *equality() {
-  Node *node = relational();
+  if (equal(cc->token, "while")) {
+    Node *node = new_node(cc, ND_WHILE);
+    cc->token = cc->token->next;
+    cc->token = skip(cc, cc->token, "(");
+    node->cond = expr(cc);
+    cc->token = skip(cc, cc->token, ")");
+
+    // 本体で宣言された変数はこのループに属する
+    push_stmt(cc, node)->saved = cc->cur_loop;
+    cc->cur_loop = node;
+    return NULL;
+  }
 
-  for (;;) {
-    if (equal(token, "==")) {
-      token = token->next;
-      node = new_binary(ND_EQ, node, relational());
-      continue;
+  if (equal(cc->token, "for")) {
+    Node *node = new_node(cc, ND_FOR);
+    cc->token = cc->token->next;
+    cc->token = skip(cc, cc->token, "(");
+    if (!equal(cc->token, ";")) {
+      node->init = expr(cc);
     }
-    if (equal(token, "!=")) {
-      token = token->next;
-      node = new_binary(ND_NE, node, relational());
-      continue;
+    cc->token = skip(cc, cc->token, ";");
+    if (!equal(cc->token, ";")) {
+      node->cond = expr(cc);
     }
+    cc->token = skip(cc, cc->token, ";");
+    if (!equal(cc->token, ")")) {
+      node->inc = expr(cc);
+    }
+    cc->token = skip(cc, cc->token, ")");
 
-    return node;
+    push_stmt(cc, node)->saved = cc->cur_loop;
+    cc->cur_loop = node;
+    return NULL;
+  }
+
+  if (equal(cc->token, "{")) {
+    cc->token = cc->token->next;
+    Node *node = new_node(cc, ND_BLOCK);
+    if (block_continue(cc, push_stmt(cc, node))) {
+      cc->stmt_len--;
+      return node;
+    }
+    return NULL;
   }
+
+  return expr_stmt(cc);
 }
 
-// relational = add ("<" add | "<=" add | ">=" add)*
-Node *relational() {
-  Node *node = add();
+// stmt = return" expr ";"
+//      | "{" compound-stmt
+//      | "if" "(" expr ")" stmt ( "else" stmt)?
+//      | "while" "(" expr ")" stmt
+//      | "for" "(" expr? ";" expr? ";" expr? ")" stmt
+//      | expr-stmt
+// compound-stmt = (declaration | stmt)* "}"
+Node *stmt(Compiler *cc) {
+  int base = cc->stmt_len;
 
   for (;;) {
-    if (equal(token, "<")) {
-      token = token->next;
-      node = new_binary(ND_LT, node, add());
-      continue;
-    }
-    if (equal(token, "<=")) {
-      token = token->next;
-      node = new_binary(ND_LE, node, add());
-      continue;
-    }
-    if (equal(token, ">")) {
-      token = token->next;
-      node = new_binary(ND_LT, add(), node);
-      continue;
-    }
-    if (equal(token, ">=")) {
-      token = token->next;
-      node = new_binary(ND_LE, add(), node);
+    Node *node = stmt_head(cc);
+    if (!node)
       continue;
-    }
 
-    return node;
+    // 完成した文を、それを囲む文に繋げていく
+    for (;;) {
+      if (cc->stmt_len == base)
+        return node;
+
+      StmtFrame *f = &cc->stmt_stack[cc->stmt_len - 1];
+      Node *parent = f->node;
+
+      if (parent->kind == ND_IF && !parent->then) {
+        parent->then = node;
+        if (equal(cc->token, "else")) {
+          cc->token = cc->token->next;
+          break;
+        }
+      } else if (parent->kind == ND_IF) {
+        parent->els = node;
+      } else if (parent->kind == ND_WHILE || parent->kind == ND_FOR) {
+        parent->then = node;
+        cc->cur_loop = f->saved;
+      } else {
+        block_append(f, node);
+        if (!block_continue(cc, f))
+          break;
+      }
+
+      cc->stmt_len--;
+      node = parent;
+    }
   }
 }
 
+// 複合文の要素(宣言か文)を1つパースする
+Node *block_item(Compiler *cc) {
+  if (equal(cc->token, "int"))
+    return declaration(cc);
+  return stmt(cc);
+}
+
 // '+'は数値だけでなくポインタの演算にも使われる.
 // p+nはポインタに整数値 nを足すのではなく、sizeof(*p)*nを足す.
-Node *new_add(Node *lhs, Node *rhs) {
-  add_type(lhs);
-  add_type(rhs);
+Node *new_add(Compiler *cc, Node *lhs, Node *rhs) {
+  add_type(cc, lhs);
+  add_type(cc, rhs);
 
   // num + num
   if (is_integer(lhs->ty) && is_integer(rhs->ty)) {
-    return new_binary(ND_ADD, lhs, rhs);
+    return new_binary(cc, ND_ADD, lhs, rhs);
   }
 
   // ptr + prtは許容していない
   if (lhs->ty->base && rhs->ty->base) {
-    error_tok(token, "invalid operands");
+    error_tok(cc, cc->token, "invalid operands");
   }
 
   // num + ptr は ptr + num へスワップする
@@ -334,24 +350,24 @@ Node *new_add(Node *lhs, Node *rhs) {
   }
 
   // ptr + num
-  rhs = new_binary(ND_MUL, rhs, new_num_node(8));
-  return new_binary(ND_ADD, lhs, rhs);
+  rhs = new_binary(cc, ND_MUL, rhs, new_num_node(cc, lhs->ty->base->size));
+  return new_binary(cc, ND_ADD, lhs, rhs);
 }
 
-Node *new_sub(Node *lhs, Node *rhs) {
-  add_type(lhs);
-  add_type(rhs);
+Node *new_sub(Compiler *cc, Node *lhs, Node *rhs) {
+  add_type(cc, lhs);
+  add_type(cc, rhs);
 
   // num - num
   if (is_integer(lhs->ty) && is_integer(rhs->ty)) {
-    return new_binary(ND_SUB, lhs, rhs);
+    return new_binary(cc, ND_SUB, lhs, rhs);
   }
 
   // ptr - num
   if (lhs->ty->base && is_integer(rhs->ty)) {
-    rhs = new_binary(ND_MUL, rhs, new_num_node(8));
-    add_type(rhs);
-    Node *node = new_binary(ND_SUB, lhs, rhs);
+    rhs = new_binary(cc, ND_MUL, rhs, new_num_node(cc, lhs->ty->base->size));
+    add_type(cc, rhs);
+    Node *node = new_binary(cc, ND_SUB, lhs, rhs);
     node->ty = lhs->ty;
     return node;
   }
@@ -359,128 +375,395 @@ Node *new_sub(Node *lhs, Node *rhs) {
   // ptr - ptr
   // ポインタ同士の減算は、間に要素がいくつかあるか計算する
   if (lhs->ty->base && rhs->ty->base) {
-    Node *node = new_binary(ND_SUB, lhs, rhs);
+    Node *node = new_binary(cc, ND_SUB, lhs, rhs);
     node->ty = ty_int;
-    return new_binary(ND_DIV, node, new_num_node(8));
+    return new_binary(cc, ND_DIV, node, new_num_node(cc, lhs->ty->base->size));
   }
 
-  error_tok(token, "invalid operands");
+  error_tok(cc, cc->token, "invalid operands");
 }
 
-// add = mul ("+" mul | "-" mul)*
-Node *add() {
-  Node *node = mul();
-
-  for (;;) {
-    if (equal(token, "+")) {
-      token = token->next;
-      node = new_add(node, mul());
-      continue;
-    }
-    if (equal(token, "-")) {
-      token = token->next;
-      node = new_sub(node, mul());
-      continue;
-    }
+//
+// 式のパース
+//
+// 優先順位法で式をパースする。深く入れ子になった式でもC言語のスタックを
+// 消費しないように、オペランドと演算子をそれぞれ明示的なスタックに積む。
+//
+// expr    = assign
+// assign  = equality ("=" assign)?
+// equality = relational ("==" relational | "!=" relational)*
+// relational = add ("<" add | "<=" add | ">" add | ">=" add)*
+// add     = mul ("+" mul | "-" mul)*
+// mul     = unary ("*" unary | "/" unary)*
+// unary   = ("+" | "-" | "*" | "&") unary
+//         | primary
+// primary = num | ident args? | "(" expr ")"
+// args    = "(" (assign ("," assign)*)? ")"
+//
+// 引数のある関数呼び出しは、"f("をOP_CALLとして積み、引数を括弧の中の
+// 式のように読む。引数の区切りにはOP_COMMAを積んでおき、")"で数える。
+//
+
+// 演算子の結合の強さ。大きいほど強く結合する
+int op_prec[] = {
+    [OP_PAREN] = 0, [OP_ASSIGN] = 1, [OP_EQ] = 2,    [OP_NE] = 2,
+    [OP_LT] = 3,    [OP_LE] = 3,     [OP_GT] = 3,    [OP_GE] = 3,
+    [OP_ADD] = 4,   [OP_SUB] = 4,    [OP_MUL] = 5,   [OP_DIV] = 5,
+    [OP_NEG] = 6,   [OP_ADDR] = 6,   [OP_DEREF] = 6,
+    [OP_CALL] = 0,  [OP_COMMA] = 0,
+};
+
+void push_op(Compiler *cc, OpKind op) {
+  if (cc->op_len == cc->op_cap) {
+    cc->op_cap = cc->op_cap ? cc->op_cap * 2 : 64;
+    cc->op_stack = realloc(cc->op_stack, sizeof(OpKind) * cc->op_cap);
+  }
+  cc->op_stack[cc->op_len++] = op;
+}
 
-    return node;
+void push_operand(Compiler *cc, Node *node) {
+  if (cc->operand_len == cc->operand_cap) {
+    cc->operand_cap = cc->operand_cap ? cc->operand_cap * 2 : 64;
+    cc->operand_stack = realloc(cc->operand_stack, sizeof(Node *) * cc->operand_cap);
   }
+  cc->operand_stack[cc->operand_len++] = node;
 }
 
-// mul = unary ("*" unary | "/" unary)*
-Node *mul() {
-  Node *node = unary();
+// 演算子スタックの先頭の演算子をオペランドに適用する
+void reduce(Compiler *cc) {
+  OpKind op = cc->op_stack[--cc->op_len];
 
-  for (;;) {
-    if (equal(token, "*")) {
-      token = token->next;
-      node = new_binary(ND_MUL, node, unary());
-      continue;
-    }
-    if (equal(token, "/")) {
-      token = token->next;
-      node = new_binary(ND_DIV, node, unary());
-      continue;
-    }
+  if (op == OP_NEG || op == OP_ADDR || op == OP_DEREF) {
+    Node *lhs = cc->operand_stack[cc->operand_len - 1];
+    NodeKind kind = op == OP_NEG ? ND_NEG : op == OP_ADDR ? ND_ADDR : ND_DEREF;
+    cc->operand_stack[cc->operand_len - 1] = new_unary(cc, kind, lhs);
+    return;
+  }
 
-    return node;
+  Node *rhs = cc->operand_stack[--cc->operand_len];
+  Node *lhs = cc->operand_stack[cc->operand_len - 1];
+  Node *node;
+
+  switch (op) {
+  case OP_ASSIGN:
+    node = new_binary(cc, ND_ASSIGN, lhs, rhs);
+    break;
+  case OP_EQ:
+    node = new_binary(cc, ND_EQ, lhs, rhs);
+    break;
+  case OP_NE:
+    node = new_binary(cc, ND_NE, lhs, rhs);
+    break;
+  case OP_LT:
+    node = new_binary(cc, ND_LT, lhs, rhs);
+    break;
+  case OP_LE:
+    node = new_binary(cc, ND_LE, lhs, rhs);
+    break;
+  case OP_GT:
+    node = new_binary(cc, ND_LT, rhs, lhs);
+    break;
+  case OP_GE:
+    node = new_binary(cc, ND_LE, rhs, lhs);
+    break;
+  case OP_ADD:
+    node = new_add(cc, lhs, rhs);
+    break;
+  case OP_SUB:
+    node = new_sub(cc, lhs, rhs);
+    break;
+  case OP_MUL:
+    node = new_binary(cc, ND_MUL, lhs, rhs);
+    break;
+  case OP_DIV:
+    node = new_binary(cc, ND_DIV, lhs, rhs);
+    break;
+  default:
+    error(cc, "invalid operator");
   }
+  cc->operand_stack[cc->operand_len - 1] = node;
 }
 
-// unary = ("+" | "-" | "*" | "&") unary
-//       | primary
-Node *unary() {
-  if (equal(token, "+")) {
-    token = token->next;
-    return unary();
-  }
+// オペランドスタックの先頭nargs個を、その下の関数呼び出しの引数にする
+void reduce_call(Compiler *cc, int nargs) {
+  if (nargs > MAX_ARGS)
+    error_tok(cc, cc->token, "too many arguments");
 
-  if (equal(token, "-")) {
-    token = token->next;
-    return new_unary(ND_NEG, unary());
-  }
+  cc->operand_len -= nargs;
+  Node *node = cc->operand_stack[cc->operand_len - 1];
+  Node head = {};
+  Node *cur = &head;
+  for (int i = 0; i < nargs; i++)
+    cur = cur->next = cc->operand_stack[cc->operand_len + i];
+  node->args = head.next;
+}
 
-  if (equal(token, "&")) {
-    token = token->next;
-    return new_unary(ND_ADDR, unary());
-  }
+// 最も内側の開いている括弧が関数呼び出しのものか
+bool in_call(Compiler *cc, int op_base) {
+  for (int i = cc->op_len - 1; i >= op_base; i--)
+    if (cc->op_stack[i] == OP_PAREN || cc->op_stack[i] == OP_CALL)
+      return cc->op_stack[i] == OP_CALL;
+  return false;
+}
 
-  if (equal(token, "*")) {
-    token = token->next;
-    return new_unary(ND_DEREF, unary());
+// 現在のトークンが二項演算子なら、その種類をopに入れてtrueを返す
+bool binary_op(Compiler *cc, OpKind *op) {
+  static struct {
+    char *str;
+    OpKind op;
+  } ops[] = {
+      {"=", OP_ASSIGN}, {"==", OP_EQ}, {"!=", OP_NE}, {"<", OP_LT},
+      {"<=", OP_LE},    {">", OP_GT},  {">=", OP_GE}, {"+", OP_ADD},
+      {"-", OP_SUB},    {"*", OP_MUL}, {"/", OP_DIV},
+  };
+
+  if (cc->token->kind != TK_RESERVED)
+    return false;
+  for (int i = 0; i < sizeof(ops) / sizeof(*ops); i++) {
+    if (equal(cc->token, ops[i].str)) {
+      *op = ops[i].op;
+      return true;
+    }
   }
-
-  return primary();
+  return false;
 }
 
-// primary = num | ident args? | "(" expr ")"
-// args = "(" ")"
-Node *primary() {
-  // 次のトークンが"("なら、"(" expr ")"のはず
-  if (equal(token, "(")) {
-    token = token->next;
-    Node *node = expr();
-    token = skip(token, ")");
-    return node;
+// expr = assign
+Node *expr(Compiler *cc) { return assign(cc); }
+
+Node *assign(Compiler *cc) {
+  int op_base = cc->op_len;
+  int operand_base = cc->operand_len;
+  int parens = 0; // 閉じていない括弧の数
+
+  for (;;) {
+    // 前置演算子と開き括弧を読む
+    for (;;) {
+      if (equal(cc->token, "+")) {
+        cc->token = cc->token->next;
+      } else if (equal(cc->token, "-")) {
+        cc->token = cc->token->next;
+        push_op(cc, OP_NEG);
+      } else if (equal(cc->token, "&")) {
+        cc->token = cc->token->next;
+        push_op(cc, OP_ADDR);
+      } else if (equal(cc->token, "*")) {
+        cc->token = cc->token->next;
+        push_op(cc, OP_DEREF);
+      } else if (equal(cc->token, "(")) {
+        cc->token = cc->token->next;
+        push_op(cc, OP_PAREN);
+        parens++;
+      } else if (cc->token->kind == TK_IDENT && equal(cc->token->next, "(") &&
+                 !equal(cc->token->next->next, ")")) {
+        Node *node = new_node(cc, ND_FUNCALL);
+        node->funcname = arena_strndup(cc, cc->token->loc, cc->token->len);
+        cc->token = cc->token->next->next;
+        push_operand(cc, node);
+        push_op(cc, OP_CALL);
+        parens++;
+      } else {
+        break;
+      }
+    }
+
+    push_operand(cc, primary(cc));
+
+    // 閉じ括弧を読み、括弧の中の演算子を適用する
+    OpKind op;
+    for (;;) {
+      if (equal(cc->token, ")") && parens > 0) {
+        int nargs = 1;
+        for (;;) {
+          OpKind top = cc->op_stack[cc->op_len - 1];
+          if (top == OP_PAREN || top == OP_CALL)
+            break;
+          if (top == OP_COMMA) {
+            cc->op_len--;
+            nargs++;
+          } else {
+            reduce(cc);
+          }
+        }
+        if (cc->op_stack[--cc->op_len] == OP_CALL)
+          reduce_call(cc, nargs);
+        parens--;
+        cc->token = cc->token->next;
+        continue;
+      }
+
+      // 引数の区切り。この引数の演算子をすべて適用する
+      if (equal(cc->token, ",") && in_call(cc, op_base)) {
+        while (cc->op_stack[cc->op_len - 1] != OP_CALL &&
+               cc->op_stack[cc->op_len - 1] != OP_COMMA)
+          reduce(cc);
+        op = OP_COMMA;
+        break;
+      }
+
+      if (binary_op(cc, &op))
+        break;
+
+      // 式の終わり
+      if (parens > 0)
+        error_tok(cc, cc->token, "expected ')'");
+      while (cc->op_len > op_base)
+        reduce(cc);
+      assert(cc->operand_len == operand_base + 1);
+      return cc->operand_stack[--cc->operand_len];
+    }
+
+    // 代入は右結合、それ以外は左結合
+    int prec = op_prec[op];
+    while (op != OP_COMMA && cc->op_len > op_base) {
+      int top = op_prec[cc->op_stack[cc->op_len - 1]];
+      if (top < prec || (top == prec && op == OP_ASSIGN))
+        break;
+      reduce(cc);
+    }
+    push_op(cc, op);
+    cc->token = cc->token->next;
   }
+}
 
-  if (token->kind == TK_IDENT) {
+// primary = num | ident ("(" ")")?
+// 引数のある関数呼び出しと括弧の式はassignで読む
+Node *primary(Compiler *cc) {
+  if (cc->token->kind == TK_IDENT) {
     // 関数呼び出し
-    if (equal(token->next, "(")) {
-      Node *node = new_node(ND_FUNCALL);
-      node->funcname = strndup(token->loc, token->len);
-      token = token->next;
-      token = skip(token, "(");
-      token = skip(token, ")");
+    if (equal(cc->token->next, "(")) {
+      Node *node = new_node(cc, ND_FUNCALL);
+      node->funcname = arena_strndup(cc, cc->token->loc, cc->token->len);
+      cc->token = cc->token->next;
+      cc->token = skip(cc, cc->token, "(");
+      cc->token = skip(cc, cc->token, ")");
       return node;
     }
 
     // 変数
-    Obj *var = find_lvar(token);
+    Obj *var = find_lvar(cc, cc->token);
     if (!var) {
-      error_tok(token, "undefined variable");
+      error_tok(cc, cc->token, "undefined variable");
     }
-    token = token->next;
-    return new_var_node(var);
+    cc->token = cc->token->next;
+    return new_var_node(cc, var);
   }
 
   // 数値
-  if (token->kind == TK_NUM) {
-    Node *node = new_num_node(token->val);
-    token = token->next;
+  if (cc->token->kind == TK_NUM) {
+    Node *node = new_num_node(cc, cc->token->val);
+    cc->token = cc->token->next;
     return node;
   }
 
-  error_tok(token, "expected an expression");
+  error_tok(cc, cc->token, "expected an expression");
 }
 
-// program = stmt*
-Function *parse(Token *tok) {
-  token = tok;
-  token = skip(token, "{");
+// function = "int" ident "(" (param ("," param)*)? ")" "{" compound-stmt
+// param = declspec declarator
+// progは先に読んだ関数のリストで、同じ名前の関数があればエラーにする
+Function *function(Compiler *cc, Function *prog) {
+  cc->token = skip(cc, cc->token, "int");
+  Function *fn = arena_alloc(cc, sizeof(Function));
+  fn->name = get_ident(cc, cc->token);
+  if (find_function(prog, fn->name))
+    error_tok(cc, cc->token, "redefinition of %s", fn->name);
+  cc->token = skip(cc, cc->token->next, "(");
+  cc->locals = NULL;
+
+  Token *names[MAX_ARGS];
+  Type *types[MAX_ARGS];
+  int n = 0;
+  while (!equal(cc->token, ")")) {
+    if (n > 0)
+      cc->token = skip(cc, cc->token, ",");
+    if (n == MAX_ARGS)
+      error_tok(cc, cc->token, "too many parameters");
+    types[n] = declarator(cc, declspec(cc), &names[n]);
+    n++;
+  }
+  cc->token = cc->token->next;
+
+  // localsの末尾に宣言順に並ぶよう、後ろの引数から作る
+  for (int i = n - 1; i >= 0; i--) {
+    Obj *var = new_lvar(cc, get_ident(cc, names[i]), types[i]);
+    var->len = names[i]->len;
+  }
+  fn->params = cc->locals;
+
+  if (!equal(cc->token, "{"))
+    error_tok(cc, cc->token, "expected '{'");
+  fn->body = stmt(cc);
+  phase_begin(cc, "add_type");
+  add_type(cc, fn->body);
+  phase_end(cc);
+  fn->locals = cc->locals;
+  return fn;
+}
+
+// 同じプログラムで定義した関数の呼び出しについて、引数の数が合っているか
+// 確かめる。ほかのファイルの関数は分からないので確かめない
+void check_calls(Compiler *cc, Function *prog) {
+  int cap = 64;
+  Node **stack = malloc(sizeof(Node *) * cap);
+
+  for (Function *fn = prog; fn; fn = fn->next) {
+    int len = 0;
+    stack[len++] = fn->body;
+    while (len > 0) {
+      Node *node = stack[--len];
+      Function *callee =
+          node->kind == ND_FUNCALL ? find_function(prog, node->funcname) : NULL;
+      if (callee) {
+        int nargs = 0, nparams = 0;
+        for (Node *arg = node->args; arg; arg = arg->next)
+          nargs++;
+        for (Obj *var = callee->params; var; var = var->next)
+          nparams++;
+        if (nargs != nparams) {
+          free(stack);
+          error(cc, "%s: %s takes %d arguments, but %d given", fn->name,
+                callee->name, nparams, nargs);
+        }
+      }
+
+      Node **kids[] = NODE_CHILDREN(node);
+      for (int i = 0; i < NCHILDREN; i++) {
+        if (!*kids[i])
+          continue;
+        if (len == cap) {
+          cap *= 2;
+          stack = realloc(stack, sizeof(Node *) * cap);
+        }
+        stack[len++] = *kids[i];
+      }
+    }
+  }
+  free(stack);
+}
+
+// program = "{" compound-stmt | function*
+// 複合文だけのプログラムは、引数のない関数(mainか--entryの名前)の本体になる
+Function *parse(Compiler *cc, Token *tok) {
+  cc->token = tok;
+  if (equal(cc->token, "{")) {
+    Function *prog = arena_alloc(cc, sizeof(Function));
+    prog->name = cc->entry ? cc->entry : "main";
+    prog->body = stmt(cc);
+    phase_begin(cc, "add_type");
+    add_type(cc, prog->body);
+    phase_end(cc);
+    prog->locals = cc->locals;
+    expect_eof(cc);
+    return prog;
+  }
 
-  Function *prog = calloc(1, sizeof(Function));
-  prog->body = compound_stmt();
-  prog->locals = locals;
-  return prog;
+  Function head = {};
+  Function *cur = &head;
+  while (!at_eof(cc))
+    cur = cur->next = function(cc, head.next);
+  if (!head.next)
+    error_tok(cc, cc->token, "expected '{'");
+  check_calls(cc, head.next);
+  return head.next;
 }
@@ -0,0 +1,403 @@
+// プロファイルに基づく最適化
+//
+// -fprofile-generateでは、ifの各腕とループの入口と本体の先頭に回数を数える
+// 命令を埋め込む。回数は関数ごとのレコードとして.dataに置き、終了時に
+// .fini_arrayから呼ぶ関数がシステムコールでファイルに追記する。
+//
+// レコードの形式 (すべて8バイト単位、リトルエンディアン):
+//   "CCCPROF1" | 構文木のハッシュ | 回数の個数n | 名前の長さ | 名前 | 回数 x n
+//
+// -fprofile-useでは、名前と構文木のハッシュが一致するレコードの回数を
+// 足し合わせてコード生成に使う。ソースが変わってハッシュが合わなければ
+// 警告してプロファイルを使わない。
+
+#include "Ccc.h"
+
+#define PGO_MAGIC "CCCPROF1"
+// ループ本体に埋め込むのを許すノードの数
+#define UNROLL_MAX_NODES 64
+// 選択をcmovにするときの式のノードの数の上限
+#define CMOV_MAX_NODES 16
+
+void ccc_set_profile_generate(Compiler *cc, const char *path) {
+  free(cc->pgo_path);
+  cc->pgo_path = path ? strdup(path) : NULL;
+}
+
+void free_pgo(PgoData *data) {
+  if (!data)
+    return;
+  for (int i = 0; i < data->len; i++) {
+    free(data->funcs[i].name);
+    free(data->funcs[i].counts);
+  }
+  free(data->funcs);
+  free(data);
+}
+
+PgoFunc *find_pgo_func(PgoData *data, char *name, unsigned long hash) {
+  for (int i = 0; i < data->len; i++)
+    if (data->funcs[i].hash == hash && !strcmp(data->funcs[i].name, name))
+      return &data->funcs[i];
+  return NULL;
+}
+
+int align8(int n) { return (n + 7) / 8 * 8; }
+
+int ccc_set_profile_use(Compiler *cc, const void *buf, size_t len) {
+  PgoData *data = calloc(1, sizeof(PgoData));
+  const char *p = buf;
+  const char *end = p + len;
+
+  while (p < end) {
+    unsigned long hdr[4];
+    if (end - p < (long)sizeof(hdr) || memcmp(p, PGO_MAGIC, 8))
+      goto bad;
+    memcpy(hdr, p, sizeof(hdr));
+    unsigned long n = hdr[2], namelen = hdr[3];
+    p += sizeof(hdr);
+    if (namelen == 0 || namelen > 4096 || n > INT_MAX / 8 ||
+        (unsigned long)(end - p) < align8(namelen) + n * 8)
+      goto bad;
+
+    char *name = strndup(p, namelen);
+    p += align8(namelen);
+
+    // 同じ関数の複数回の実行は足し合わせる
+    PgoFunc *fn = find_pgo_func(data, name, hdr[1]);
+    if (fn && fn->ncounts != (int)n) {
+      free(name);
+      goto bad;
+    }
+    if (!fn) {
+      data->funcs = realloc(data->funcs, sizeof(PgoFunc) * (data->len + 1));
+      fn = &data->funcs[data->len++];
+      *fn = (PgoFunc){name, hdr[1], calloc(n ? n : 1, sizeof(long)), n};
+    } else {
+      free(name);
+    }
+    for (unsigned long i = 0; i < n; i++) {
+      long c;
+      memcpy(&c, p + i * 8, 8);
+      fn->counts[i] += c;
+    }
+    p += n * 8;
+  }
+
+  free_pgo(cc->pgo);
+  cc->pgo = data;
+  return 0;
+
+bad:
+  free_pgo(data);
+  free(cc->errmsg);
+  cc->errmsg = strdup("invalid profile data\n");
+  return -1;
+}
+
+const char *ccc_warnings(Compiler *cc) { return cc->warnings; }
+
+void warn(Compiler *cc, char *fmt, ...) {
+  char *buf;
+  size_t len;
+  FILE *fp = open_memstream(&buf, &len);
+  if (cc->warnings)
+    fputs(cc->warnings, fp);
+
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(fp, fmt, ap);
+  va_end(ap);
+  fclose(fp);
+  free(cc->warnings);
+  cc->warnings = buf;
+}
+
+// 構文木のハッシュ (FNV-1a) を求め、ifとループにカウンタの番号を振る
+unsigned long number_branches(Compiler *cc, Node *body) {
+  unsigned long h = 14695981039346656037UL;
+#define MIX(x) (h = (h ^ (unsigned long)(x)) * 1099511628211UL)
+
+  int len = 0, cap = 64;
+  Node **stack = malloc(sizeof(Node *) * cap);
+  stack[len++] = body;
+  cc->nbranches = 0;
+
+  while (len) {
+    Node *node = stack[--len];
+    MIX(node->kind);
+    MIX(node->val);
+    MIX(node->var ? node->var->offset : 0);
+    for (char *p = node->funcname; p && *p; p++)
+      MIX(*p);
+    if (node->kind == ND_IF || node->kind == ND_WHILE || node->kind == ND_FOR)
+      node->prof_id = cc->nbranches++;
+
+    Node **children[] = NODE_CHILDREN(node);
+    for (int i = NCHILDREN - 1; i >= 0; i--) {
+      MIX(*children[i] != NULL);
+      if (!*children[i])
+        continue;
+      if (len == cap)
+        stack = realloc(stack, sizeof(Node *) * (cap *= 2));
+      stack[len++] = *children[i];
+    }
+  }
+#undef MIX
+  free(stack);
+  return h;
+}
+
+// 関数のコード生成を始める前に、カウンタを用意するかプロファイルを探す
+void begin_pgo(Compiler *cc, Function *fn) {
+  cc->pgo_counts = NULL;
+  if (!cc->pgo_path && !cc->pgo)
+    return;
+
+  // 回数を数えるときは、分岐の配置を変えずにカウンタを置く
+  cc->pgo_hash = number_branches(cc, fn->body);
+  if (!cc->pgo || cc->pgo_path)
+    return;
+
+  PgoFunc *pf = find_pgo_func(cc->pgo, fn->name, cc->pgo_hash);
+  if (pf && pf->ncounts == cc->nbranches * 2) {
+    cc->pgo_counts = pf->counts;
+  } else {
+    for (int i = 0; i < cc->pgo->len; i++) {
+      if (!strcmp(cc->pgo->funcs[i].name, fn->name)) {
+        warn(cc, "warning: profile for %s does not match the source; "
+                 "ignoring it\n", fn->name);
+        break;
+      }
+    }
+    return;
+  }
+
+  // 冷たい腕は関数の後ろにまとめて出力する
+  cc->hot = cc->out;
+  cc->cold = open_memstream(&cc->cold_buf, &cc->cold_len);
+  if (!cc->cold)
+    error(cc, "out of memory");
+}
+
+// 行外に出した腕を関数の本体の後ろに書き出す
+void flush_cold(Compiler *cc) {
+  if (!cc->cold)
+    return;
+  fclose(cc->cold);
+  cc->cold = NULL;
+  fwrite(cc->cold_buf, 1, cc->cold_len, cc->out);
+  free(cc->cold_buf);
+  cc->cold_buf = NULL;
+}
+
+void end_pgo(Compiler *cc, Function *fn) {
+  if (!cc->pgo_path)
+    return;
+
+  int namelen = strlen(fn->name);
+  int size = 32 + align8(namelen) + cc->nbranches * 16;
+
+  // レコードと書き出す関数は計測のためのもので、fnの命令には数えない
+  StatsTable *stats = cc->stats;
+  cc->stats = NULL;
+
+  println(cc, "  .data");
+  println(cc, "  .balign 8");
+  println(cc, ".L.prof.%s:", fn->name);
+  println(cc, "  .ascii \"%s\"", PGO_MAGIC);
+  println(cc, "  .quad %lu", cc->pgo_hash);
+  println(cc, "  .quad %d", cc->nbranches * 2);
+  println(cc, "  .quad %d", namelen);
+  println(cc, "  .ascii \"%s\"", fn->name);
+  println(cc, "  .balign 8");
+  println(cc, ".L.prof.%s.counts:", fn->name);
+  println(cc, "  .zero %d", cc->nbranches * 16);
+  println(cc, ".L.prof.%s.path:", fn->name);
+  fprintf(cc->out, "  .asciz ");
+  print_asm_string(cc->out, cc->pgo_path);
+  fprintf(cc->out, "\n");
+
+  // open(path, O_WRONLY|O_CREAT|O_APPEND, 0644)してレコードを1回で書く
+  println(cc, "  .text");
+  println(cc, ".L.prof.%s.dump:", fn->name);
+  println(cc, "  .cfi_startproc");
+  println(cc, "  mov $2, %%eax");
+  println(cc, "  lea .L.prof.%s.path(%%rip), %%rdi", fn->name);
+  println(cc, "  mov $%d, %%esi", 01 | 0100 | 02000);
+  println(cc, "  mov $%d, %%edx", 0644);
+  println(cc, "  syscall");
+  println(cc, "  test %%eax, %%eax");
+  println(cc, "  js  .L.prof.%s.done", fn->name);
+  println(cc, "  mov %%rax, %%rdi");
+  println(cc, "  lea .L.prof.%s(%%rip), %%rsi", fn->name);
+  println(cc, "  mov $%d, %%edx", size);
+  println(cc, "  mov $1, %%eax");
+  println(cc, "  syscall");
+  println(cc, "  mov $3, %%eax");
+  println(cc, "  syscall");
+  println(cc, ".L.prof.%s.done:", fn->name);
+  println(cc, "  ret");
+  println(cc, "  .cfi_endproc");
+  println(cc, "  .section .fini_array,\"aw\"");
+  println(cc, "  .balign 8");
+  println(cc, "  .quad .L.prof.%s.dump", fn->name);
+  println(cc, "  .text");
+  cc->stats = stats;
+}
+
+// 分岐nodeのedge番目の辺を通った回数を数える命令を出力する
+void count_edge(Compiler *cc, Node *node, int edge) {
+  if (cc->pgo_path)
+    println(cc, "  incq .L.prof.%s.counts+%d(%%rip)", cc->cur_fn->name,
+            (node->prof_id * 2 + edge) * 8);
+}
+
+// 分岐nodeのedge番目の辺を通った回数。プロファイルがなければ-1
+long edge_count(Compiler *cc, Node *node, int edge) {
+  if (!cc->pgo_counts)
+    return -1;
+  return cc->pgo_counts[node->prof_id * 2 + edge];
+}
+
+// limitまでノードを数える。limitを超えたらlimit+1を返す
+int count_nodes_upto(Node *node, int limit) {
+  int n = 0, len = 0;
+  Node *stack[UNROLL_MAX_NODES * NCHILDREN + 1];
+  stack[len++] = node;
+  while (len) {
+    Node *nd = stack[--len];
+    if (++n > limit)
+      return n;
+    Node **children[] = NODE_CHILDREN(nd);
+    for (int i = 0; i < NCHILDREN; i++)
+      if (*children[i])
+        stack[len++] = *children[i];
+  }
+  return n;
+}
+
+// 副作用がなく、先に評価しても例外を起こさない式か
+bool is_pure(Node *node) {
+  int len = 0;
+  Node *stack[CMOV_MAX_NODES + 2];
+  stack[len++] = node;
+  while (len) {
+    Node *nd = stack[--len];
+    switch (nd->kind) {
+    case ND_NUM:
+    case ND_VAR:
+      continue;
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+      stack[len++] = nd->rhs;
+      // fallthrough
+    case ND_NEG:
+      stack[len++] = nd->lhs;
+      continue;
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+// 1つの文だけの複合文をほどく
+Node *single_stmt(Node *node) {
+  while (node && node->kind == ND_BLOCK && node->body && !node->body->next)
+    node = node->body;
+  return node;
+}
+
+// "x = E"の形の文ならxへの代入の式を返す
+Node *var_assign(Node *stmt) {
+  stmt = single_stmt(stmt);
+  if (!stmt || stmt->kind != ND_EXPR_STMT || stmt->lhs->kind != ND_ASSIGN ||
+      stmt->lhs->lhs->kind != ND_VAR)
+    return NULL;
+  Node *rhs = stmt->lhs->rhs;
+  if (rhs->ty->size != stmt->lhs->ty->size ||
+      count_nodes_upto(rhs, CMOV_MAX_NODES) > CMOV_MAX_NODES || !is_pure(rhs))
+    return NULL;
+  return stmt->lhs;
+}
+
+// "if (c) x = A; else x = B;"をcmovで選べるなら、xへの2つの代入を返す。
+// elseがなければBはx自身になる
+bool cmov_candidate(Node *node, Node **then, Node **els) {
+  *then = var_assign(node->then);
+  if (!*then)
+    return false;
+  if (!node->els) {
+    *els = NULL;
+    return true;
+  }
+  *els = var_assign(node->els);
+  return *els && (*els)->lhs->var == (*then)->lhs->var;
+}
+
+// ループ本体を展開してよいほど小さいか。ループを含む本体は展開しない
+bool unrollable(Node *node) {
+  int limit = UNROLL_MAX_NODES;
+  int n = count_nodes_upto(node->then, limit);
+  if (node->inc)
+    n += count_nodes_upto(node->inc, limit);
+  if (n > limit)
+    return false;
+
+  int len = 0;
+  Node *stack[UNROLL_MAX_NODES + NCHILDREN];
+  stack[len++] = node->then;
+  while (len) {
+    Node *nd = stack[--len];
+    if (nd->kind == ND_WHILE || nd->kind == ND_FOR)
+      return false;
+    Node **children[] = NODE_CHILDREN(nd);
+    for (int i = 0; i < NCHILDREN; i++)
+      if (*children[i])
+        stack[len++] = *children[i];
+  }
+  return true;
+}
+
+// プロファイルの回数からifの配置を決める
+IfLayout if_layout(Compiler *cc, Node *node) {
+  long then = edge_count(cc, node, 0);
+  long els = edge_count(cc, node, 1);
+  if (then < 0 || then + els == 0)
+    return IF_DEFAULT;
+
+  // どちらにも偏らない分岐は予測を外しやすいので、分岐をなくす
+  Node *a, *b;
+  long min = then < els ? then : els;
+  if (min * 5 >= then + els && cmov_candidate(node, &a, &b))
+    return IF_CMOV;
+
+  // 行外に出した腕の中では、さらに行外に出さない
+  if (cc->out == cc->cold)
+    return IF_DEFAULT;
+  if (then >= els)
+    return node->els ? IF_COLD_ELSE : IF_DEFAULT;
+  return IF_COLD_THEN;
+}
+
+// ループ本体を並べる数。0ならループを変形しない。1以上なら条件を
+// ループの末尾に移し、平均の繰り返し回数に応じて本体を複製する
+int unroll_count(Compiler *cc, Node *node) {
+  long entries = edge_count(cc, node, 0);
+  long iters = edge_count(cc, node, 1);
+  if (!node->cond || entries <= 0 || iters < entries)
+    return 0;
+  if (!unrollable(node))
+    return 1;
+  if (iters >= entries * 16)
+    return 4;
+  if (iters >= entries * 4)
+    return 2;
+  return 1;
+}
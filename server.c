@@ -0,0 +1,302 @@
+// コンパイルサーバとそのクライアント
+//
+// サーバはUnixドメインソケットで待ち受け、接続ごとにスレッドを立てて
+// リクエストを処理する。プロセスの起動やメモリの初期化のコストを
+// リクエストごとに払わずに済む。
+//
+// 1つの接続で複数のリクエストを順に送ることができる。
+//   リクエスト: 種類(1バイト) 長さ(4バイト、ビッグエンディアン) ソース
+//     種類は 'S' (アセンブリを返す) か 'O' (オブジェクトファイルを返す)
+//   レスポンス: 状態(1バイト) 長さ(4バイト、ビッグエンディアン) 本体
+//     状態が0なら本体は出力、1ならエラーメッセージ
+
+#include "Ccc.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+// リクエストの最大の大きさ
+#define MAX_REQUEST (64 * 1024 * 1024)
+
+char *server_path;
+
+// 短い読み書きやシグナルによる中断があっても、全部読み書きする
+bool read_full(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool write_full(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// 種類または状態の1バイトと長さの4バイトからなるヘッダを読み書きする
+bool read_header(int fd, char *kind, uint32_t *len) {
+  unsigned char buf[5];
+  if (!read_full(fd, buf, 5))
+    return false;
+  *kind = buf[0];
+  *len = (uint32_t)buf[1] << 24 | buf[2] << 16 | buf[3] << 8 | buf[4];
+  return true;
+}
+
+bool write_frame(int fd, char kind, char *body, uint32_t len) {
+  unsigned char buf[5] = {kind, len >> 24, len >> 16, len >> 8, len};
+  return write_full(fd, buf, 5) && write_full(fd, body, len);
+}
+
+char *read_path(char *path, size_t *len) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return NULL;
+
+  char *buf;
+  FILE *out = open_memstream(&buf, len);
+  char buf2[4096];
+  int n;
+  while ((n = fread(buf2, 1, sizeof(buf2), fp)) > 0)
+    fwrite(buf2, 1, n, out);
+  fclose(fp);
+  fclose(out);
+  return buf;
+}
+
+// アセンブリをasでアセンブルしてオブジェクトファイルの中身を返す
+char *assemble(char *asm_buf, size_t asm_len, size_t *obj_len) {
+  char dir[] = "/tmp/ccc-XXXXXX";
+  if (!mkdtemp(dir))
+    return NULL;
+
+  char s_path[64], o_path[64];
+  snprintf(s_path, sizeof(s_path), "%s/out.s", dir);
+  snprintf(o_path, sizeof(o_path), "%s/out.o", dir);
+
+  char *obj = NULL;
+  FILE *fp = fopen(s_path, "w");
+  if (fp) {
+    bool ok = fwrite(asm_buf, 1, asm_len, fp) == asm_len;
+    if (fclose(fp) == 0 && ok) {
+      char *argv[] = {"as", "-o", o_path, s_path, NULL};
+      pid_t pid;
+      int status;
+      if (posix_spawnp(&pid, "as", NULL, NULL, argv, environ) == 0 &&
+          waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+          WEXITSTATUS(status) == 0)
+        obj = read_path(o_path, obj_len);
+    }
+  }
+
+  unlink(s_path);
+  unlink(o_path);
+  rmdir(dir);
+  return obj;
+}
+
+// 1つの接続のリクエストを順に処理する
+void *serve_conn(void *arg) {
+  int fd = (int)(intptr_t)arg;
+  Compiler *cc = ccc_new();
+
+  for (;;) {
+    char kind;
+    uint32_t len;
+    if (!read_header(fd, &kind, &len))
+      break;
+
+    if ((kind != 'S' && kind != 'O') || len > MAX_REQUEST) {
+      char *msg = "invalid request\n";
+      write_frame(fd, 1, msg, strlen(msg));
+      break;
+    }
+
+    char *src = malloc(len + 1);
+    if (!read_full(fd, src, len)) {
+      free(src);
+      break;
+    }
+    src[len] = '\0';
+
+    // オブジェクトファイルはアセンブルした結果をキャッシュする
+    char key[65];
+    char *flags = kind == 'O' ? "O entry=main" : "S entry=main";
+    char *out = NULL;
+    size_t out_len;
+    bool ok;
+    if (cache_dir) {
+      cache_key(src, flags, key);
+      out = cache_lookup(key, &out_len);
+    }
+
+    if (out) {
+      ok = write_frame(fd, 0, out, out_len);
+      free(out);
+    } else if (ccc_compile(cc, src, &out, &out_len) != 0) {
+      const char *msg = ccc_error(cc);
+      ok = write_frame(fd, 1, (char *)msg, strlen(msg));
+    } else {
+      if (kind == 'O') {
+        size_t obj_len;
+        char *obj = assemble(out, out_len, &obj_len);
+        free(out);
+        out = obj;
+        out_len = obj_len;
+      }
+
+      if (out) {
+        if (cache_dir)
+          cache_store(key, out, out_len);
+        ok = write_frame(fd, 0, out, out_len);
+        free(out);
+      } else {
+        char *msg = "assembler failed\n";
+        ok = write_frame(fd, 1, msg, strlen(msg));
+      }
+    }
+    free(src);
+    cache_flush_stats();
+
+    if (!ok)
+      break;
+  }
+
+  ccc_free(cc);
+  close(fd);
+  return NULL;
+}
+
+void stop_server(int sig) {
+  unlink(server_path);
+  _exit(0);
+}
+
+int connect_socket(char *path, bool listen_on) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  if (listen_on) {
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 128) < 0) {
+      perror(path);
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int run_server(char *path) {
+  int sock = connect_socket(path, true);
+  if (sock < 0)
+    return 1;
+
+  server_path = path;
+  signal(SIGINT, stop_server);
+  signal(SIGTERM, stop_server);
+  signal(SIGPIPE, SIG_IGN);
+
+  for (;;) {
+    int fd = accept(sock, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror("accept");
+      return 1;
+    }
+
+    pthread_t thr;
+    if (pthread_create(&thr, NULL, serve_conn, (void *)(intptr_t)fd) != 0) {
+      close(fd);
+      continue;
+    }
+    pthread_detach(thr);
+  }
+}
+
+// サーバにソースを送り、結果をoutputに書く。
+// kindは'S'ならアセンブリ、'O'ならオブジェクトファイル
+int run_client(char *path, char kind, char *src, char *output) {
+  int fd = connect_socket(path, false);
+  if (fd < 0)
+    return 1;
+
+  char status;
+  uint32_t len;
+  if (!write_frame(fd, kind, src, strlen(src)) ||
+      !read_header(fd, &status, &len)) {
+    fprintf(stderr, "%s: connection closed\n", path);
+    return 1;
+  }
+
+  char *body = malloc(len + 1);
+  if (!read_full(fd, body, len)) {
+    fprintf(stderr, "%s: connection closed\n", path);
+    return 1;
+  }
+  close(fd);
+
+  if (status != 0) {
+    fwrite(body, 1, len, stderr);
+    return 1;
+  }
+
+  FILE *out = stdout;
+  if (strcmp(output, "-")) {
+    out = fopen(output, "w");
+    if (!out) {
+      perror(output);
+      return 1;
+    }
+  }
+  fwrite(body, 1, len, out);
+  if (out != stdout)
+    fclose(out);
+  free(body);
+  return 0;
+}
@@ -0,0 +1,112 @@
+// 生成したコードの統計
+//
+// コード生成が出力した命令を関数ごとに種類別に数える。計測しないときは
+// cc->statsがNULLで、printlnは命令を調べない。
+//
+// loadsとstoresは命令に書いたメモリのオペランドを数える。incqのように
+// メモリを読んでから書く命令は両方に数える。push、pop、call、retが暗黙に
+// 読み書きするスタックはloadsとstoresに含めず、pushとpopの数で見る。
+
+#include "Ccc.h"
+
+void ccc_enable_stats(Compiler *cc) {
+  if (!cc->stats)
+    cc->stats = calloc(1, sizeof(StatsTable));
+}
+
+// 前回のコンパイルの統計を捨てる
+void clear_stats(StatsTable *t) {
+  for (int i = 0; i < t->len; i++)
+    free(t->data[i].name);
+  t->len = 0;
+}
+
+void free_stats(StatsTable *t) {
+  if (!t)
+    return;
+  clear_stats(t);
+  free(t->data);
+  free(t);
+}
+
+// 関数fnの統計を取り始める。フレームの大きさは決まっていること
+void begin_fn_stats(Compiler *cc, Function *fn) {
+  StatsTable *t = cc->stats;
+  if (t->len == t->cap) {
+    t->cap = t->cap ? t->cap * 2 : 16;
+    t->data = realloc(t->data, sizeof(FnStats) * t->cap);
+  }
+  t->data[t->len++] = (FnStats){.name = strdup(fn->name),
+                                .frame_size = fn->stack_size};
+  cc->max_depth = 0;
+}
+
+void end_fn_stats(Compiler *cc) {
+  cc->stats->data[cc->stats->len - 1].max_depth = cc->max_depth;
+}
+
+bool startswith(char *p, char *q) { return strncmp(p, q, strlen(q)) == 0; }
+
+// アセンブリの1行を調べて数える。ラベルと疑似命令は数えない
+void count_insn(Compiler *cc, char *line) {
+  if (!startswith(line, "  ") || line[2] == '.' || cc->stats->len == 0)
+    return;
+  FnStats *s = &cc->stats->data[cc->stats->len - 1];
+  char *op = line + 2;
+  s->insns++;
+
+  if (startswith(op, "push"))
+    s->pushes++;
+  else if (startswith(op, "pop"))
+    s->pops++;
+  else if (op[0] == 'j')
+    s->branches++;
+  else if (startswith(op, "call"))
+    s->calls++;
+  else if (startswith(op, "idiv"))
+    s->idivs++;
+  else if (startswith(op, "imul"))
+    s->imuls++;
+
+  // AT&T記法では最後のオペランドが書き込み先になる。オペランドが1つなら
+  // inc、dec、neg、not、setだけがそこに書き込む
+  char *mem = strchr(op, '(');
+  if (!mem || startswith(op, "lea"))
+    return;
+  char *comma = strrchr(op, ',');
+  bool dest = comma ? mem > comma
+                    : startswith(op, "inc") || startswith(op, "dec") ||
+                          startswith(op, "neg") || startswith(op, "not") ||
+                          startswith(op, "set");
+  bool reads = !dest || !(startswith(op, "mov") || startswith(op, "set"));
+  bool writes = dest && !startswith(op, "cmp") && !startswith(op, "test");
+  s->loads += reads;
+  s->stores += writes;
+}
+
+// 最後のコンパイルの統計を1関数1行のJSONで書き出す
+void ccc_write_stats(Compiler *cc, const char *file, FILE *out) {
+  StatsTable *t = cc->stats;
+  if (!t)
+    return;
+
+  for (int i = 0; i < t->len; i++) {
+    FnStats *s = &t->data[i];
+    fprintf(out, "{");
+    if (file) {
+      fprintf(out, "\"file\": ");
+      print_json_string(out, (char *)file);
+      fprintf(out, ", ");
+    }
+    fprintf(out, "\"function\": ");
+    print_json_string(out, s->name);
+    fprintf(out,
+            ", \"instructions\": %d, \"push\": %d, "
+            "\"pop\": %d, \"loads\": %d, \"stores\": %d, \"branches\": %d, "
+            "\"calls\": %d, \"idiv\": %d, \"imul\": %d, \"frame_size\": %d, "
+            "\"max_depth\": %d}\n",
+            s->insns, s->pushes, s->pops, s->loads, s->stores,
+            s->branches, s->calls, s->idivs, s->imuls, s->frame_size,
+            s->max_depth);
+  }
+}
@@ -3,25 +3,172 @@
 cat <<EOF | gcc -xc -c -o tmp2.o -
 int ret3() { return 3; }
 int ret5() { return 5; }
+int add(int x, int y) { return x+y; }
+int sub(int x, int y) { return x-y; }
+int add6(int a, int b, int c, int d, int e, int f) { return a+b+c+d+e+f; }
+int aligned() { return ((long)__builtin_frame_address(0) & 15) == 0; }
 EOF
 
+# テストケースはassertとassert_stdinで登録しておき、run_casesでまとめて
+# 確かめる。各ケースをcase_Nという関数として並列にコンパイルし、
+# 呼び出し表を持つ1つの実行ファイルにリンクして1つのプロセスで実行する
+JOBS=${JOBS:-$(nproc)}
+rm -rf tmp-cases
+mkdir tmp-cases
+ncases=0
+case_names=()
+case_expected=()
+
+add_case() {
+  case_expected[ncases]="$1"
+  case_names[ncases]="$2"
+  ncases=$((ncases + 1))
+}
+
 assert() {
+  printf '%s' "$2" > tmp-cases/$ncases.in
+  add_case "$1" "$2"
+}
+
+# 標準入力から読んだtmp.inをコンパイルして実行する
+assert_stdin() {
+  cp tmp.in tmp-cases/$ncases.in
+  add_case "$1" "$2"
+}
+
+# ケース$1をコンパイルしてアセンブルし、かかった時間をマイクロ秒で残す
+compile_case() {
+  local start=${EPOCHREALTIME/./}
+  ./Ccc --entry=case_$1 - < tmp-cases/$1.in > tmp-cases/$1.s 2> tmp-cases/$1.err &&
+    as -o tmp-cases/$1.o tmp-cases/$1.s 2>> tmp-cases/$1.err
+  echo $? $((${EPOCHREALTIME/./} - start)) > tmp-cases/$1.compile
+}
+
+run_cases() {
+  local running=0 i
+  for ((i = 0; i < ncases; i++)); do
+    compile_case $i &
+    running=$((running + 1))
+    if ((running >= JOBS)); then
+      wait -n
+      running=$((running - 1))
+    fi
+  done
+  wait
+
+  # コンパイルできたケースを呼び出し表に並べる
+  local status=() compile_us=() objs=() failed=0
+  {
+    echo '#include <stdio.h>'
+    echo '#include <stdlib.h>'
+    echo '#include <time.h>'
+    for ((i = 0; i < ncases; i++)); do
+      read -r status[i] compile_us[i] < tmp-cases/$i.compile
+      if [ "${status[i]}" = 0 ]; then
+        echo "int case_$i(void);"
+        objs+=(tmp-cases/$i.o)
+      fi
+    done
+    echo 'struct { int id; int (*fn)(void); } cases[] = {'
+    for ((i = 0; i < ncases; i++)); do
+      [ "${status[i]}" = 0 ] && echo "  {$i, case_$i},"
+    done
+    echo '};'
+    cat <<'EOF2'
+// argv[1]番目から順に呼び出し、「番号 結果 ナノ秒」を1行ずつ出す
+int main(int argc, char **argv) {
+  int n = sizeof(cases) / sizeof(*cases);
+  for (int i = argc > 1 ? atoi(argv[1]) : 0; i < n; i++) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int r = cases[i].fn();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("%d %d %ld\n", cases[i].id, r & 255,
+           (t1.tv_sec - t0.tv_sec) * 1000000000L + t1.tv_nsec - t0.tv_nsec);
+    fflush(stdout);
+  }
+  return 0;
+}
+EOF2
+  } > tmp-cases/main.c
+  cc -o tmp-cases/run tmp-cases/main.c "${objs[@]}" tmp2.o || exit 1
+
+  # 途中で落ちたら、そのケースを記録して次のケースから実行し直す
+  local actual=() run_ns=() next=0 id r ns
+  while :; do
+    ./tmp-cases/run $next > tmp-cases/run.out
+    local code=$?
+    while read -r id r ns; do
+      actual[id]=$r
+      run_ns[id]=$ns
+      next=$((next + 1))
+    done < tmp-cases/run.out
+    [ $code = 0 ] && break
+    for ((i = 0, id = -1; i < ncases; i++)); do
+      [ "${status[i]}" = 0 ] && [ -z "${actual[i]}" ] && { id=$i; break; }
+    done
+    [ $id -lt 0 ] && break
+    actual[id]="signal $((code - 128))"
+    next=$((next + 1))
+  done
+
+  for ((i = 0; i < ncases; i++)); do
+    local expected=${case_expected[i]} name=${case_names[i]}
+    local time="compile $((compile_us[i] / 1000))ms"
+    if [ "${status[i]}" != 0 ]; then
+      echo "$name => $expected expected, but failed to compile ($time)"
+      cat tmp-cases/$i.err
+      failed=1
+    elif [ "${actual[i]}" = "$expected" ]; then
+      echo "$name => ${actual[i]} ($time, run $((run_ns[i] / 1000))us)"
+    else
+      echo "$name => $expected expected, but got ${actual[i]} ($time)"
+      failed=1
+    fi
+  done
+  [ $failed = 0 ] || exit 1
+}
+
+# プログラムに編集を適用してからコンパイルして実行する
+assert_edit() {
   expected="$1"
   input="$2"
+  shift 2
 
-  ./Ccc "$input" > tmp.s
+  ./Ccc "$@" "$input" > tmp.s || exit 1
   cc -o tmp tmp.s tmp2.o
   ./tmp
   actual="$?"
 
   if [ "$actual" = "$expected" ]; then
-    echo "$input => $actual"
+    echo "$input $* => $actual"
+  else
+    echo "$input $* => $expected expected, but got $actual"
+    exit 1
+  fi
+}
+
+# 関数を定義するプログラムは、ケースごとに別の実行ファイルにする。
+# $3があれば結果の表示にプログラムの代わりに使う
+assert_prog() {
+  ./Ccc "$2" > tmp.s || exit 1
+  cc -o tmp tmp.s tmp2.o
+  ./tmp
+  actual="$?"
+
+  if [ "$actual" = "$1" ]; then
+    echo "${3:-$2} => $actual"
   else
-    echo "$input => $expected expected, but got $actual"
+    echo "${3:-$2} => $1 expected, but got $actual"
     exit 1
   fi
 }
 
+# 文字列$1を$2回繰り返す
+repeat() {
+  printf "%.0s$1" $(seq "$2")
+}
+
 assert 0 '{ return 0; }'
 assert 42 '{ return 42; }'
 assert 21 '{ return 5+20-4; }'
@@ -84,17 +231,231 @@ assert 3 '{ for (;;) return 3; return 5; }'
 assert 3 '{ {1; {2;} return 3;} }'
 assert 5 '{ ;;; return 5; }'
 
+assert 7 '{ int s=0; {int a=3; s=s+a;} {int b=4; s=s+b;} return s; }'
+assert 100 '{ int i=0; int s=0; while (i<10) { {int t=i*2; s=s+t;} {int u=1; s=s+u;} i=i+1; } return s; }'
+assert 45 '{ int s=0; int k=0; int i=0; for (i=0; i<10; i=i+1) { s=s+k; k=i+1; } return s; }'
+
 assert 3 '{ int x=3; return *&x; }'
-assert 3 '{ int x=3; int y=&x; int z=&y; return **z; }'
+assert 3 '{ int x=3; int *y=&x; int **z=&y; return **z; }'
 assert 5 '{ int x=3; int y=5; return *(&x+1); }'
 assert 3 '{ int x=3; int y=5; return *(&y-1); }'
-assert 5 '{ int x=3; int y=&x; *y=5; return x; }'
+assert 5 '{ int x=3; int *y=&x; *y=5; return x; }'
 assert 5 '{ int x=3; int y=5; return *(&x-(-1)); }'
 assert 7 '{ int x=3; int y=5; *(&x+1)=7; return y; }'
 assert 7 '{ int x=3; int y=5; *(&y-1)=7; return x; }'
 assert 5 '{ int x=3; return (&x+2)-&x+3; }'
+assert 5 '{ int x=3; int y=5; int *p=&x; return *(p+1); }'
+assert 1 '{ int x=2147483647; x=x+1; return x<0; }'
+assert 3 '{ int x=-7; return -x/2; }'
+assert 1 '{ int ab=1; int ac=2; return ab; }'
 
 assert 3 '{ return ret3(); }'
 assert 5 '{ return ret5(); }'
+assert 8 '{ return ret3()+ret5(); }'
+assert 8 '{ return add(3, 5); }'
+assert 2 '{ return sub(5, 3); }'
+assert 21 '{ return add6(1,2,3,4,5,6); }'
+assert 66 '{ return add6(1,2,add6(3,4,5,6,7,8),9,10,11); }'
+assert 1 '{ return aligned(); }'
+assert 2 '{ return aligned()+1; }'
+assert 3 '{ return 1+add(aligned(), aligned()); }'
+
+# 長い式や深い入れ子でもC言語のスタックを溢れさせないことを確かめる
+{ printf '{ return '; repeat '1+' 99999; printf '1; }'; } > tmp.in
+assert_stdin 160 '100000-term + chain'
+{ printf '{ return '; repeat '1+(' 99999; printf '1'; repeat ')' 99999; printf '; }'; } > tmp.in
+assert_stdin 160 '100000-term right-nested + chain'
+{ printf '{ return '; repeat '(' 100000; printf '42'; repeat ')' 100000; printf '; }'; } > tmp.in
+assert_stdin 42 '100000 nested parentheses'
+{ printf '{ return '; repeat '-' 100000; printf '5; }'; } > tmp.in
+assert_stdin 5 '100000 nested unary -'
+{ repeat '{' 100000; printf 'return 7;'; repeat '}' 100000; } > tmp.in
+assert_stdin 7 '100000 nested blocks'
+{ printf '{ '; repeat 'if (1) ' 100000; printf 'return 9; return 0; }'; } > tmp.in
+assert_stdin 9 '100000 nested if'
+{ printf '{ int i=0; '; repeat 'while (i<1) ' 100000; printf 'return 4; return 0; }'; } > tmp.in
+assert_stdin 4 '100000 nested while'
+run_cases
+
+# 関数の定義。何も呼ばない関数はフレームを作らずレッドゾーンを使う
+assert_prog 7 'int main() { return add2(3, 4); } int add2(int x, int y) { return x+y; }'
+assert_prog 55 'int main() { return fib(10); } int fib(int n) { if (n<=1) return n; return fib(n-1)+fib(n-2); }'
+assert_prog 21 'int main() { return sum6(1,2,3,4,5,6); } int sum6(int a, int b, int c, int d, int e, int f) { return a+b+c+d+e+f; }'
+assert_prog 5 'int main() { int x=3; set(&x, 5); return x; } int set(int *p, int v) { *p=v; return 0; }'
+assert_prog 1 'int main() { return aligned()*one(); } int one() { return 1; }'
+assert_prog 12 'int main() { return g(1,2)+g(3,3); } int g(int a, int b) { return (a+b)*(b-a+1); }'
+{ printf 'int main() { return big(1); } int big(int x) { '; for i in $(seq 40); do printf 'int v%d=x+%d; ' $i $i; done
+  printf 'return v1'; for i in $(seq 2 40); do printf '+v%d' $i; done; printf '; }'; } > tmp.in
+assert_prog 92 "$(cat tmp.in)" 'leaf with 40 locals'
+./Ccc 'int main() { return sq(3); } int sq(int x) { return x*x; }' > tmp.s || exit 1
+[ "$(grep -c 'push %rbp' tmp.s)" = 1 ] || { cat tmp.s; exit 1; }
+./Ccc 'int main() { return f(1,2,3,4,5,6,7); }' 2> /dev/null && exit 1
+./Ccc 'int f() { return 1; } int f() { return 2; }' 2> /dev/null && exit 1
+./Ccc 'int main() { return add2(1); } int add2(int x, int y) { return x+y; }' 2> /dev/null && exit 1
+./Ccc 'int main() { return add2(1, 2, 3); } int add2(int x, int y) { return x+y; }' 2> /dev/null && exit 1
+
+# 複数のファイルを並列にコンパイルする
+echo '{ return 12; }' > tmp-a.in
+echo '{ int x=3; return x*x; }' > tmp-b.in
+./Ccc -j2 -o tmp-a.s -o tmp-b.s tmp-a.in tmp-b.in || exit 1
+for t in a:12 b:9; do
+  f=${t%:*}
+  expected=${t#*:}
+  cc -o tmp tmp-$f.s tmp2.o
+  ./tmp
+  actual="$?"
+  if [ "$actual" != "$expected" ]; then
+    echo "tmp-$f.in => $expected expected, but got $actual"
+    exit 1
+  fi
+  echo "tmp-$f.in => $actual"
+done
+
+# 編集した文だけをパースし直しても、最初からコンパイルした結果と同じになる
+assert_edit 6 '{ int x=1; return x+1; }' --edit=18,19,5
+assert_edit 7 '{ int x=1; return x+1; }' --edit=11,11,'x=x*3; ' --edit=27,28,4
+assert_edit 3 '{ int x=1; return x+1; }' --edit=20,21, --edit=20,20,2
+assert_edit 6 '{ int x=1; return x+1; }' --edit=11,11,'int y=4; ' --edit=29,29,y+
+assert_edit 5 '{ int x=1; if (x) x=2; return x; }' --edit=22,22,' else x=3;' --edit=15,16,0 --edit=40,41,x+2
+assert_edit 19 'int main() { return add2(3, 4); } int add2(int x, int y) { return x+y; }' --edit=66,66,x*y+
+assert_edit 15 'int main() { return add2(3, 4); } int add2(int x, int y) { return x+y; }' --edit=20,24,add2\(1,2\)+add3 --edit=82,82,' int add3(int a, int b) { return a*b; }'
+assert_edit 5 'int main() { return add2(3, 4); } int add2(int x, int y) { return x+y; }' --edit=33,72, --edit=20,24,ret5
+assert_edit 7 'int main() { return add2(3); } int add2(int x, int y) { return x+y; }' --edit=26,26,', 4'
+./Ccc --edit=0,0, '{ return 1; } x' 2> /dev/null && exit 1
+./Ccc --edit=13,13,y '{ return 1; }' 2> /dev/null && exit 1
+./Ccc --edit=33,33,' int main() { return 1; }' 'int main() { return add2(3, 4); } int add2(int x, int y) { return x+y; }' 2> /dev/null && exit 1
+./Ccc --edit=48,55, --edit=59,62,x 'int main() { return add2(3, 4); } int add2(int x, int y) { return x+y; }' 2> /dev/null && exit 1
+{ printf '{ int x=0; '; repeat 'x=x+1; ' 20000; printf 'return x; }'; } > tmp.in
+edits=()
+for i in $(seq 0 199); do
+  pos=$((11 + 7 * (i * 97) + 4))
+  edits+=(--edit=$pos,$((pos + 1)),2)
+done
+./Ccc "${edits[@]}" - < tmp.in > tmp-a.s || exit 1
+for i in $(seq 0 199); do
+  pos=$((11 + 7 * (i * 97) + 4))
+  printf 2 | dd of=tmp.in bs=1 seek=$pos conv=notrunc status=none
+done
+./Ccc - < tmp.in > tmp-b.s || exit 1
+cmp -s tmp-a.s tmp-b.s || { echo "200 edits differ from a full compile"; exit 1; }
+echo "200 edits => OK"
+
+# IRのモジュールをリンクし、小さな関数をインライン展開して定数を伝播する
+./Ccc --entry=ret7 -emit-ir '{ return 7; }' > tmp-a.ir || exit 1
+./Ccc --entry=twice -emit-ir '{ int x=3; int y=x*2; return y+1; }' > tmp-b.ir || exit 1
+./Ccc --entry=unused -emit-ir '{ return 1; }' > tmp-c.ir || exit 1
+./Ccc -emit-ir '{ int i=0; int s=0; while (i<ret7()) { s=s+twice(); i=i+1; } return s+ret3(); }' > tmp.ir || exit 1
+./Ccc --lto -o tmp.s tmp-a.ir tmp-b.ir tmp-c.ir tmp.ir || exit 1
+cc -o tmp tmp.s tmp2.o
+./tmp
+actual="$?"
+[ "$actual" = 52 ] || { echo "lto => 52 expected, but got $actual"; exit 1; }
+grep -q 'call ret7\|call twice\|unused' tmp.s && { echo "lto did not inline"; exit 1; }
+grep -q 'call ret3' tmp.s || { echo "lto dropped an external call"; exit 1; }
+head -c 100 tmp.ir > tmp-c.ir
+./Ccc --lto tmp-a.ir tmp-c.ir 2> /dev/null && { echo "lto accepted a broken module"; exit 1; }
+echo "lto => 52"
+# 引数が数値か変数の呼び出しは、仮引数を引数で置き換えて展開する。
+# 関数呼び出しのある式に変数は埋め込まない
+./Ccc -emit-ir 'int add2(int a, int b) { return a+b; } int twice2(int p) { return p*2+ret3(); }' > tmp-a.ir || exit 1
+./Ccc -emit-ir 'int main() { int x=3; x=x+ret5(); return add2(x, 4)+twice2(x)+twice2(1); }' > tmp.ir || exit 1
+./Ccc --lto -o tmp.s tmp-a.ir tmp.ir || exit 1
+cc -o tmp tmp.s tmp2.o
+./tmp
+actual="$?"
+[ "$actual" = 36 ] || { echo "lto args => 36 expected, but got $actual"; exit 1; }
+[ "$(grep -c 'call add2\|call twice2' tmp.s)" = 1 ] || { cat tmp.s; exit 1; }
+echo "lto args => 36"
+
+# 段階ごとの計測結果と、関数ごとのコード生成の区間を含むトレースを書き出す
+./Ccc --entry=fn --time-report --trace=tmp.out '{ return 3; }' > tmp.s 2> tmp-a.s || exit 1
+grep -q '^tokenize ' tmp-a.s && grep -q '^codegen ' tmp-a.s || { cat tmp-a.s; exit 1; }
+grep -q '"traceEvents"' tmp.out && grep -q '"name": "fn", "ph": "X"' tmp.out || { cat tmp.out; exit 1; }
+echo "time report => OK"
+
+# 関数ごとに生成した命令を種類別に数える
+./Ccc --stats=tmp.out '{ int x=3; return x*x/2; }' > tmp.s || exit 1
+expected='{"function": "main", "instructions": 19, "push": 0, "pop": 0, "loads": 5, "stores": 4, "branches": 1, "calls": 0, "idiv": 1, "imul": 1, "frame_size": 16, "max_depth": 2}'
+[ "$(cat tmp.out)" = "$expected" ] || { cat tmp.out; exit 1; }
+# -fprofile-generateでは回数を数えるincqだけが増え、書き出す関数は数えない。
+# incqはメモリを読んでから書くので、loadsとstoresの両方に数える
+./Ccc --stats=tmp.out -fprofile-generate=tmp.prof '{ int x=3; if (x) x=4; return x; }' > tmp.s || exit 1
+expected='{"function": "main", "instructions": 21, "push": 0, "pop": 0, "loads": 6, "stores": 6, "branches": 3, "calls": 0, "idiv": 0, "imul": 0, "frame_size": 16, "max_depth": 1}'
+[ "$(cat tmp.out)" = "$expected" ] || { cat tmp.out; exit 1; }
+echo "stats => OK"
+
+# 分岐の回数を記録し、それを使って分岐の配置とループの展開を決める
+prog='{ int i=0; int s=0; int x=0; for (i=0; i<40; i=i+1) { if (i==5) s=s+3; else s=s+1; if (i/2*2==i) x=i; else x=s; } return s+x; }'
+rm -f tmp.prof
+./Ccc -fprofile-generate=tmp.prof "$prog" > tmp.s || exit 1
+cc -o tmp tmp.s tmp2.o && ./tmp
+actual="$?"
+[ "$actual" = 84 ] || { echo "profile-generate => 84 expected, but got $actual"; exit 1; }
+[ -s tmp.prof ] || { echo "no profile written"; exit 1; }
+./Ccc -fprofile-use=tmp.prof "$prog" > tmp.s 2> tmp.out || exit 1
+[ -s tmp.out ] && { cat tmp.out; exit 1; }
+cc -o tmp tmp.s tmp2.o && ./tmp
+actual="$?"
+[ "$actual" = 84 ] || { echo "profile-use => 84 expected, but got $actual"; exit 1; }
+grep -q cmove tmp.s && grep -q '\.L\.body\.' tmp.s || { echo "profile was not used"; exit 1; }
+./Ccc -fprofile-use=tmp.prof '{ return 1; }' > tmp.s 2> tmp.out || exit 1
+grep -q 'does not match' tmp.out || { echo "stale profile was not detected"; exit 1; }
+echo "pgo => 84"
+
+# -gでは文ごとにソースの行番号と桁を出力する
+printf '{\n  int x=3;\n  if (x==3)\n    x=x*2;\n  return x;\n}\n' > tmp-cases/dbg.c
+./Ccc -g -o tmp.s tmp-cases/dbg.c || exit 1
+grep -q '^  \.file 1 "tmp-cases/dbg.c"$' tmp.s && grep -q '^  \.loc 1 4 5$' tmp.s &&
+  grep -q '^  \.cfi_startproc$' tmp.s || { cat tmp.s; exit 1; }
+cc -o tmp tmp.s && ./tmp
+actual="$?"
+[ "$actual" = 6 ] || { echo "-g => 6 expected, but got $actual"; exit 1; }
+objdump --dwarf=decodedline tmp | grep -q 'dbg.c  *4 ' || { echo "no line table"; exit 1; }
+# ファイル名の制御文字はアセンブラの8進数のエスケープにする
+cp tmp-cases/dbg.c $'tmp-cases/d\tbg.c'
+./Ccc -g -o tmp.s $'tmp-cases/d\tbg.c' || exit 1
+grep -q '^  \.file 1 "tmp-cases/d\\011bg.c"$' tmp.s && cc -c -o tmp.o tmp.s ||
+  { cat tmp.s; exit 1; }
+echo "debug info => OK"
+
+# キャッシュにヒットしても同じ結果になり、大きさの上限を超えたら古いものから消える
+rm -rf tmp-cache
+CCC_CACHE_DIR=tmp-cache ./Ccc '{ return 21; }' > tmp-a.s || exit 1
+CCC_CACHE_DIR=tmp-cache ./Ccc '{ return 21; }' > tmp-b.s || exit 1
+cmp -s tmp-a.s tmp-b.s || { echo "cache hit differs"; exit 1; }
+CCC_CACHE_DIR=tmp-cache ./Ccc --cache-stats > tmp.out
+grep -qx 'hits 1' tmp.out && grep -qx 'misses 1' tmp.out || { cat tmp.out; exit 1; }
+[ -f tmp-cache/self.id ] || { echo "compiler hash is not saved"; exit 1; }
+# 異常終了したコンパイラが残した一時ファイルは、エビクションのときに消える
+touch -d '2 hours ago' tmp-cache/tmp.1.0
+for i in 1 2 3 4 5 6; do
+  CCC_CACHE_DIR=tmp-cache CCC_CACHE_SIZE=500 ./Ccc "{ return $i; }" > /dev/null
+done
+size=$(cat tmp-cache/[0-9a-f]* | wc -c)
+[ "$size" -le 500 ] || { echo "cache is $size bytes"; exit 1; }
+[ -e tmp-cache/tmp.1.0 ] && { echo "stale tmp file is left"; exit 1; }
+echo "cache => OK"
+
+# コンパイルサーバを立ててクライアントからコンパイルする
+./Ccc --server=tmp.sock &
+server=$!
+for i in $(seq 50); do [ -S tmp.sock ] && break; sleep 0.1; done
+./Ccc --connect=tmp.sock '{ return 7; }' > tmp.s || exit 1
+echo '{ int x=6; return x*7; }' | ./Ccc --connect=tmp.sock -c -o tmp.o - || exit 1
+./Ccc --connect=tmp.sock '{ return x; }' 2> /dev/null && exit 1
+kill $server
+wait $server
+for t in s:7 o:42; do
+  f=${t%:*}
+  expected=${t#*:}
+  cc -o tmp tmp.$f tmp2.o
+  ./tmp
+  actual="$?"
+  if [ "$actual" != "$expected" ]; then
+    echo "server tmp.$f => $expected expected, but got $actual"
+    exit 1
+  fi
+  echo "server tmp.$f => $actual"
+done
 
 echo OK
\ No newline at end of file
@@ -1,39 +1,45 @@
 #include "Ccc.h"
 
-char *user_input;
-Token *token;
-
-void verror_at(char *loc, char *fmt, va_list ap) {
-  int pos = loc - user_input;
-  fprintf(stderr, "%s\n", user_input);
-  fprintf(stderr, "%*s", pos, ""); // pos個の空白を出力
-  fprintf(stderr, "^ ");
-  vfprintf(stderr, fmt, ap);
-  fprintf(stderr, "\n");
-  exit(1);
+// エラーメッセージを記録して、コンパイルを中断する
+void verror(Compiler *cc, char *loc, char *fmt, va_list ap) {
+  char *buf;
+  size_t buflen;
+  FILE *fp = open_memstream(&buf, &buflen);
+
+  if (loc) {
+    int pos = loc - cc->user_input;
+    fprintf(fp, "%s\n", cc->user_input);
+    fprintf(fp, "%*s", pos, ""); // pos個の空白を出力
+    fprintf(fp, "^ ");
+  }
+  vfprintf(fp, fmt, ap);
+  fprintf(fp, "\n");
+  fclose(fp);
+
+  free(cc->errmsg);
+  cc->errmsg = buf;
+  longjmp(cc->jmpbuf, 1);
 }
 
 // エラーを報告するための関数
 // printfと同じ引数を取る
-void error(char *fmt, ...) {
+void error(Compiler *cc, char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(stderr, fmt, ap);
-  fprintf(stderr, "\n");
-  exit(1);
+  verror(cc, NULL, fmt, ap);
 }
 
 // エラー箇所を報告する
-void error_at(char *loc, char *fmt, ...) {
+void error_at(Compiler *cc, char *loc, char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  verror_at(loc, fmt, ap);
+  verror(cc, loc, fmt, ap);
 }
 
-void error_tok(Token *tok, char *fmt, ...) {
+void error_tok(Compiler *cc, Token *tok, char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  verror_at(tok->loc, fmt, ap);
+  verror(cc, tok->loc, fmt, ap);
 }
 
 bool equal(Token *tok, char *op) {
@@ -57,7 +63,7 @@ int read_punct(char *p) {
 }
 
 bool is_keyword(Token *tok) {
-  char *kw[] = {"return", "if", "else", "for", "while", "int"};
+  static char *kw[] = {"return", "if", "else", "for", "while", "int"};
 
   for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
     if (equal(tok, kw[i]))
@@ -72,17 +78,36 @@ void convert_keywords(Token *tok) {
 }
 
 // 新しいTokenを作成する
-Token *new_token(TokenKind kind, char *start, char *end) {
-  Token *tok = calloc(1, sizeof(Token));
+Token *new_token(Compiler *cc, TokenKind kind, char *start, char *end) {
+  Token *tok = arena_alloc(cc, sizeof(Token));
   tok->kind = kind;
   tok->loc = start;
   tok->len = end - start;
   return tok;
 }
 
+// トークン列の各トークンに行番号と桁を付ける
+void add_line_numbers(Compiler *cc, Token *tok) {
+  char *p = cc->user_input;
+  char *line = p;
+  int n = 1;
+
+  do {
+    for (; p < tok->loc; p++) {
+      if (*p == '\n') {
+        line = p + 1;
+        n++;
+      }
+    }
+    tok->line_no = n;
+    tok->col = p - line + 1;
+    tok = tok->next;
+  } while (tok);
+}
+
 // 入力文字列をトークナイズしてTokenを返す
-Token *tokenize(char *p) {
-  user_input = p;
+Token *tokenize(Compiler *cc, char *p) {
+  cc->user_input = p;
   Token head;
   head.next = NULL;
   Token *cur = &head;
@@ -100,14 +125,14 @@ Token *tokenize(char *p) {
       do {
         p++;
       } while (is_alnum(*p));
-      cur->next = new_token(TK_IDENT, start, p);
+      cur->next = new_token(cc, TK_IDENT, start, p);
       cur = cur->next;
       continue;
     }
 
     // Numeric literal
     if (isdigit(*p)) {
-      cur->next = new_token(TK_NUM, p, p);
+      cur->next = new_token(cc, TK_NUM, p, p);
       cur = cur->next;
       char *q = p;
       cur->val = strtol(p, &p, 10);
@@ -118,16 +143,17 @@ Token *tokenize(char *p) {
     // Punctuator (区切字)
     int punct_len = read_punct(p);
     if (punct_len) {
-      cur->next = new_token(TK_RESERVED, p, p + punct_len);
+      cur->next = new_token(cc, TK_RESERVED, p, p + punct_len);
       cur = cur->next;
       p += cur->len;
       continue;
     }
 
-    error_at(p, "トークナイズできません");
+    error_at(cc, p, "トークナイズできません");
   }
 
-  cur->next = new_token(TK_EOF, p, p);
+  cur->next = new_token(cc, TK_EOF, p, p);
+  add_line_numbers(cc, head.next);
   convert_keywords(head.next);
   return head.next;
-}
\ No newline at end of file
+}
@@ -0,0 +1,203 @@
+// コンパイルの段階ごとの計測
+//
+// phase_beginとphase_endで囲んだ段階ごとに、経過時間とCPU時間、arenaからの
+// 確保の回数とバイト数、ピークのRSSを集計する。入れ子になった段階の分は
+// 外側の段階から差し引く。trace_beginとtrace_endの区間は集計せず、
+// トレースにだけ残す。計測しないときはcc->profがNULLで、何もしない。
+
+#include "Ccc.h"
+
+#include <sys/resource.h>
+#include <time.h>
+
+double now_usec(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void ccc_enable_profile(Compiler *cc, int tid) {
+  if (!cc->prof)
+    cc->prof = calloc(1, sizeof(Profile));
+  cc->prof->tid = tid;
+}
+
+void free_profile(Profile *prof) {
+  if (!prof)
+    return;
+  for (int i = 0; i < prof->events_len; i++)
+    free(prof->events[i].name);
+  free(prof->events);
+  free(prof->spans);
+  free(prof->phases);
+  free(prof);
+}
+
+void begin_span(Compiler *cc, char *name, bool phase) {
+  Profile *prof = cc->prof;
+  if (prof->spans_len == prof->spans_cap) {
+    prof->spans_cap = prof->spans_cap ? prof->spans_cap * 2 : 16;
+    prof->spans = realloc(prof->spans, sizeof(Span) * prof->spans_cap);
+  }
+  prof->spans[prof->spans_len++] = (Span){
+      .name = name,
+      .phase = phase,
+      .wall = now_usec(CLOCK_MONOTONIC),
+      .cpu = now_usec(CLOCK_THREAD_CPUTIME_ID),
+      .allocs = cc->alloc_count,
+      .bytes = cc->alloc_bytes,
+  };
+}
+
+void phase_begin(Compiler *cc, char *name) {
+  if (cc->prof)
+    begin_span(cc, name, true);
+}
+
+void trace_begin(Compiler *cc, char *name) {
+  if (cc->prof)
+    begin_span(cc, name, false);
+}
+
+PhaseStats *find_phase(Profile *prof, char *name) {
+  for (int i = 0; i < prof->phases_len; i++)
+    if (!strcmp(prof->phases[i].name, name))
+      return &prof->phases[i];
+
+  prof->phases = realloc(prof->phases, sizeof(PhaseStats) * ++prof->phases_len);
+  PhaseStats *p = &prof->phases[prof->phases_len - 1];
+  *p = (PhaseStats){.name = name};
+  return p;
+}
+
+void add_event(Profile *prof, TraceEvent ev) {
+  if (prof->events_len == prof->events_cap) {
+    prof->events_cap = prof->events_cap ? prof->events_cap * 2 : 64;
+    prof->events = realloc(prof->events, sizeof(TraceEvent) * prof->events_cap);
+  }
+  prof->events[prof->events_len++] = ev;
+}
+
+// 最も内側の区間を閉じる
+void trace_end(Compiler *cc) {
+  Profile *prof = cc->prof;
+  if (!prof || prof->spans_len == 0)
+    return;
+
+  Span *s = &prof->spans[--prof->spans_len];
+  double wall = now_usec(CLOCK_MONOTONIC) - s->wall;
+  double cpu = now_usec(CLOCK_THREAD_CPUTIME_ID) - s->cpu;
+  long allocs = cc->alloc_count - s->allocs;
+  size_t bytes = cc->alloc_bytes - s->bytes;
+
+  // 関数名などはコンパイルが終わると解放されるので複製しておく
+  add_event(prof, (TraceEvent){strdup(s->name), s->wall, wall, allocs, bytes,
+                               prof->tid});
+  if (!s->phase)
+    return;
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+
+  PhaseStats *p = find_phase(prof, s->name);
+  p->calls++;
+  p->wall += wall - s->child_wall;
+  p->cpu += cpu - s->child_cpu;
+  p->allocs += allocs - s->child_allocs;
+  p->bytes += bytes - s->child_bytes;
+  if (p->max_rss < ru.ru_maxrss)
+    p->max_rss = ru.ru_maxrss;
+
+  // 外側の段階からはこの段階の分を差し引く
+  for (int i = prof->spans_len - 1; i >= 0; i--) {
+    Span *outer = &prof->spans[i];
+    if (!outer->phase)
+      continue;
+    outer->child_wall += wall;
+    outer->child_cpu += cpu;
+    outer->child_allocs += allocs;
+    outer->child_bytes += bytes;
+    break;
+  }
+}
+
+void phase_end(Compiler *cc) { trace_end(cc); }
+
+void ccc_merge_profile(Compiler *dst, Compiler *src) {
+  Profile *from = src->prof;
+  if (!from)
+    return;
+  if (!dst->prof)
+    ccc_enable_profile(dst, 0);
+
+  for (int i = 0; i < from->phases_len; i++) {
+    PhaseStats *s = &from->phases[i];
+    PhaseStats *p = find_phase(dst->prof, s->name);
+    p->calls += s->calls;
+    p->wall += s->wall;
+    p->cpu += s->cpu;
+    p->allocs += s->allocs;
+    p->bytes += s->bytes;
+    if (p->max_rss < s->max_rss)
+      p->max_rss = s->max_rss;
+  }
+
+  for (int i = 0; i < from->events_len; i++) {
+    add_event(dst->prof, from->events[i]);
+    from->events[i].name = NULL;
+  }
+  from->events_len = 0;
+}
+
+void ccc_time_report(Compiler *cc, FILE *out) {
+  Profile *prof = cc->prof;
+  if (!prof)
+    return;
+
+  fprintf(out, "%-10s %6s %10s %10s %10s %12s %12s\n", "phase", "calls",
+          "wall(ms)", "cpu(ms)", "allocs", "bytes", "max_rss(KB)");
+  PhaseStats total = {.name = "total"};
+  for (int i = 0; i <= prof->phases_len; i++) {
+    PhaseStats *p = i < prof->phases_len ? &prof->phases[i] : &total;
+    fprintf(out, "%-10s %6d %10.3f %10.3f %10ld %12zu %12ld\n", p->name,
+            p->calls, p->wall / 1e3, p->cpu / 1e3, p->allocs, p->bytes,
+            p->max_rss);
+
+    total.calls += p->calls;
+    total.wall += p->wall;
+    total.cpu += p->cpu;
+    total.allocs += p->allocs;
+    total.bytes += p->bytes;
+    if (total.max_rss < p->max_rss)
+      total.max_rss = p->max_rss;
+  }
+}
+
+void print_json_string(FILE *out, char *s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fputc('\\', out);
+    if ((unsigned char)*s < 0x20)
+      fprintf(out, "\\u%04x", *s);
+    else
+      fputc(*s, out);
+  }
+  fputc('"', out);
+}
+
+// Chromeのトレースイベントの形式で書き出す
+int ccc_write_trace(Compiler *cc, FILE *out) {
+  Profile *prof = cc->prof;
+  fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  for (int i = 0; prof && i < prof->events_len; i++) {
+    TraceEvent *ev = &prof->events[i];
+    fprintf(out, "%s\n  {\"name\": ", i ? "," : "");
+    print_json_string(out, ev->name);
+    fprintf(out, ", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, "
+                 "\"tid\": %d, \"args\": {\"allocs\": %ld, \"bytes\": %zu}}",
+            ev->ts, ev->dur, ev->tid, ev->allocs, ev->bytes);
+  }
+  fprintf(out, "\n]}\n");
+  return ferror(out) ? -1 : 0;
+}
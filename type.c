@@ -1,33 +1,20 @@
 #include "Ccc.h"
 
-Type *ty_int = &(Type){TY_INT};
+Type *ty_int = &(Type){TY_INT, 4, 4};
 
 bool is_integer(Type *ty) { return ty->kind == TY_INT; }
 
-Type *pointer_to(Type *base) {
-  Type *ty = calloc(1, sizeof(Type));
+Type *pointer_to(Compiler *cc, Type *base) {
+  Type *ty = arena_alloc(cc, sizeof(Type));
   ty->kind = TY_PTR;
+  ty->size = 8;
+  ty->align = 8;
   ty->base = base;
   return ty;
 }
 
-void add_type(Node *node) {
-  if (!node || node->ty) {
-    return;
-  }
-
-  add_type(node->lhs);
-  add_type(node->rhs);
-  add_type(node->cond);
-  add_type(node->then);
-  add_type(node->els);
-  add_type(node->init);
-  add_type(node->inc);
-
-  for (Node *n = node->body; n; n = n->next) {
-    add_type(n);
-  }
-
+// 子の型が決まったノードに型を付ける
+void set_type(Compiler *cc, Node *node) {
   switch (node->kind) {
   case ND_ADD:
   case ND_SUB:
@@ -49,14 +36,51 @@ void add_type(Node *node) {
     node->ty = node->var->ty;
     return;
   case ND_ADDR:
-    node->ty = pointer_to(node->lhs->ty);
+    node->ty = pointer_to(cc, node->lhs->ty);
     return;
   case ND_DEREF:
     if (node->lhs->ty->kind != TY_PTR) {
       // error_tok(node->token, "invalid pointer dereference");
-      error("invalid pointer dereference");
+      error(cc, "invalid pointer dereference");
     }
     node->ty = node->lhs->ty->base;
     return;
   }
 }
+
+void push_type(Compiler *cc, Node *node, bool expanded) {
+  if (!node || node->ty)
+    return;
+  if (cc->type_len == cc->type_cap) {
+    cc->type_cap = cc->type_cap ? cc->type_cap * 2 : 64;
+    cc->type_stack = realloc(cc->type_stack, sizeof(TypeFrame) * cc->type_cap);
+  }
+  cc->type_stack[cc->type_len++] = (TypeFrame){node, expanded};
+}
+
+// 木を帰りがけ順にたどって型を付ける。深い木でも再帰しない
+void add_type(Compiler *cc, Node *node) {
+  int base = cc->type_len;
+  push_type(cc, node, false);
+
+  while (cc->type_len > base) {
+    TypeFrame f = cc->type_stack[--cc->type_len];
+    if (f.expanded) {
+      set_type(cc, f.node);
+      continue;
+    }
+
+    push_type(cc, f.node, true);
+    push_type(cc, f.node->lhs, false);
+    push_type(cc, f.node->rhs, false);
+    push_type(cc, f.node->cond, false);
+    push_type(cc, f.node->then, false);
+    push_type(cc, f.node->els, false);
+    push_type(cc, f.node->init, false);
+    push_type(cc, f.node->inc, false);
+    for (Node *n = f.node->body; n; n = n->next)
+      push_type(cc, n, false);
+    for (Node *n = f.node->args; n; n = n->next)
+      push_type(cc, n, false);
+  }
+}